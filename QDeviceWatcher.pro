@@ -11,6 +11,13 @@ test.depends += libqdevicewatcher
 testgui.file = test/hotplugwatcher_gui.pro
 testgui.depends += libqdevicewatcher
 
+#synthetic uevents through the Linux backend, see test/main_bench.cpp
+linux {
+    SUBDIRS += bench
+    bench.file = test/hotplugbench.pro
+    bench.depends += libqdevicewatcher
+}
+
 OTHER_FILES += \
     TODO.txt \
     README
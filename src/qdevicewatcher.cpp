@@ -20,6 +20,21 @@
 #include "qdevicewatcher.h"
 #include "qdevicewatcher_p.h"
 
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDateTime>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QMetaMethod>
+#include <QtCore/QMutex>
+#include <QtCore/QtEndian>
+
+#include <atomic>
+#include <string.h>
+#ifdef Q_OS_LINUX
+#include <sys/sysmacros.h>
+#include <time.h>
+#endif //Q_OS_LINUX
+
 QDeviceWatcher::QDeviceWatcher(QObject *parent)
     : QObject(parent)
     , running(false)
@@ -27,6 +42,8 @@ QDeviceWatcher::QDeviceWatcher(QObject *parent)
 {
     Q_D(QDeviceWatcher);
     d->setWatcher(this);
+    qRegisterMetaType<QDeviceUEvent>("QDeviceUEvent");
+    qRegisterMetaType<QList<QDeviceUEvent> >("QList<QDeviceUEvent>");
 }
 
 QDeviceWatcher::~QDeviceWatcher()
@@ -66,39 +83,1486 @@ void QDeviceWatcher::appendEventReceiver(QObject *receiver)
     d->event_receivers.append(receiver);
 }
 
-void QDeviceWatcherPrivate::emitDeviceAdded(const QString &dev)
+void QDeviceWatcher::setDelivery(DeliveryFlags flags)
+{
+    Q_D(QDeviceWatcher);
+    d->delivery = flags;
+}
+
+QDeviceWatcher::DeliveryFlags QDeviceWatcher::delivery() const
+{
+    return d_func()->delivery;
+}
+
+QDeviceSnapshot QDeviceWatcher::snapshot() const
+{
+    return d_func()->snapshots.acquire();
+}
+
+QDeviceWatcherStatistics::QDeviceWatcherStatistics()
+{
+    memset(this, 0, sizeof(*this));
+}
+
+QDeviceWatcherStatistics QDeviceWatcher::statistics() const
+{
+    const QDeviceWatcherCounters &c = d_func()->counters;
+    QDeviceWatcherStatistics stats;
+    stats.datagrams = c.datagrams.loadRelaxed();
+    stats.bytes = c.bytes.loadRelaxed();
+    for (int i = 0; i <= QDeviceUEvent::Unknown; ++i)
+        stats.events[i] = c.events[i].loadRelaxed();
+    stats.filtered = c.filtered.loadRelaxed();
+    stats.overflows = c.overflows.loadRelaxed();
+    stats.missedEvents = c.missed.loadRelaxed();
+    stats.coalesced = c.coalesced.loadRelaxed();
+#ifdef Q_OS_LINUX
+    if (d_func()->reader)
+        stats.queueDepth = d_func()->reader->queueDepth();
+#endif //Q_OS_LINUX
+    stats.queueHighWater = c.queue_high_water.loadRelaxed();
+    stats.receiveBufferSize = d_func()->rcvbuf_size.loadRelaxed();
+    stats.receiveBufferHighWater = c.rcvbuf_high_water.loadRelaxed();
+    c.parse_time.copyTo(stats.parseTime);
+    c.dispatch_time.copyTo(stats.dispatchTime);
+    c.receive_latency.copyTo(stats.receiveLatency);
+    c.delivery_latency.copyTo(stats.deliveryLatency);
+    return stats;
+}
+
+QList<QDeviceUEvent> QDeviceWatcher::devices() const
+{
+    return snapshot().devices();
+}
+
+QDeviceUEvent QDeviceWatcher::parent(const QString &devPathOrNode) const
+{
+    return snapshot().parent(devPathOrNode);
+}
+
+QList<QDeviceUEvent> QDeviceWatcher::ancestors(const QString &devPathOrNode) const
+{
+    return snapshot().ancestors(devPathOrNode);
+}
+
+QList<QDeviceUEvent> QDeviceWatcher::children(const QString &devPathOrNode) const
+{
+    return snapshot().children(devPathOrNode);
+}
+
+QList<QDeviceUEvent> QDeviceWatcher::descendants(const QString &devPathOrNode) const
+{
+    return snapshot().descendants(devPathOrNode);
+}
+
+QByteArray QDeviceWatcher::attribute(const QString &devPathOrNode, const QByteArray &name) const
+{
+#ifdef Q_OS_LINUX
+    const QDeviceUEvent dev = device(devPathOrNode);
+    if (!dev.isValid() || name.isEmpty())
+        return QByteArray();
+    return d_func()->attributes.value(dev.devPath().toLocal8Bit(), name);
+#else
+    Q_UNUSED(devPathOrNode);
+    Q_UNUSED(name);
+    return QByteArray();
+#endif //Q_OS_LINUX
+}
+
+QStringList QDeviceWatcher::mountPoints(const QString &devPathOrNode) const
+{
+    QStringList mount_points;
+#ifdef Q_OS_LINUX
+    const quint64 devnum = device(devPathOrNode).deviceNumber();
+    if (devnum) {
+        foreach (const QByteArray &mount_point, d_func()->mount_table.mountPoints(devnum))
+            mount_points.append(QString::fromLocal8Bit(mount_point));
+    }
+#else
+    Q_UNUSED(devPathOrNode);
+#endif //Q_OS_LINUX
+    return mount_points;
+}
+
+QDeviceUEvent QDeviceWatcher::device(quint64 devNum) const
+{
+    return snapshot().device(devNum);
+}
+
+QDeviceUEvent QDeviceWatcher::device(const QString &devPathOrNode) const
+{
+    return snapshot().device(devPathOrNode);
+}
+
+bool QDeviceWatcher::contains(quint64 devNum) const
+{
+    return snapshot().contains(devNum);
+}
+
+bool QDeviceWatcher::contains(const QString &devPathOrNode) const
+{
+    return snapshot().contains(devPathOrNode);
+}
+
+void QDeviceWatcherPrivate::updateRegistry(const QDeviceUEvent &uevent)
+{
+    registry.update(uevent);
+    registry_changed = true;
+}
+
+//called once per batch of events
+void QDeviceWatcherPrivate::publishDevices()
+{
+    if (!registry_changed)
+        return;
+    registry_changed = false;
+    snapshots.publish(registry);
+}
+
+bool QDeviceWatcherPrivate::canChangeFilters() const
+{
+#ifdef Q_OS_LINUX
+    if (reader && reader->isRunning()) {
+        qWarning("can not change the filters while the reader thread is running");
+        return false;
+    }
+#endif //Q_OS_LINUX
+    return true;
+}
+
+static QList<QByteArray> toFilter(const QStringList &list)
+{
+    QList<QByteArray> filter;
+    foreach (const QString &s, list)
+        filter.append(s.toLocal8Bit());
+    return filter;
+}
+
+void QDeviceWatcher::setActionFilter(const QList<QDeviceUEvent::Action> &actions)
+{
+    Q_D(QDeviceWatcher);
+    if (!d->canChangeFilters())
+        return;
+    d->action_filter = actions;
+#ifdef Q_OS_LINUX
+    d->attachFilter();
+#endif //Q_OS_LINUX
+}
+
+static QList<quint32> toHashes(const QList<QByteArray> &filter)
+{
+    QList<quint32> hashes;
+    foreach (const QByteArray &f, filter)
+        hashes.append(QDeviceUEventPrivate::hash32(f.constData(), f.size()));
+    return hashes;
+}
+
+void QDeviceWatcher::setSubsystemFilter(const QStringList &subsystems)
+{
+    Q_D(QDeviceWatcher);
+    if (!d->canChangeFilters())
+        return;
+    d->subsystem_filter = toFilter(subsystems);
+    d->subsystem_hashes = toHashes(d->subsystem_filter);
+#ifdef Q_OS_LINUX
+    d->attachFilter();
+#endif //Q_OS_LINUX
+}
+
+void QDeviceWatcher::setDevTypeFilter(const QStringList &devTypes)
+{
+    Q_D(QDeviceWatcher);
+    if (!d->canChangeFilters())
+        return;
+    d->devtype_filter = toFilter(devTypes);
+    d->devtype_hashes = toHashes(d->devtype_filter);
+#ifdef Q_OS_LINUX
+    d->attachFilter();
+#endif //Q_OS_LINUX
+}
+
+void QDeviceWatcher::setTagFilter(const QStringList &tags)
+{
+    Q_D(QDeviceWatcher);
+    if (!d->canChangeFilters())
+        return;
+    d->tag_filter = toFilter(tags);
+    d->tag_blooms.clear();
+    foreach (const QByteArray &tag, d->tag_filter)
+        d->tag_blooms.append(QDeviceUEventPrivate::bloom64(tag.constData(), tag.size()));
+#ifdef Q_OS_LINUX
+    d->attachFilter();
+#endif //Q_OS_LINUX
+}
+
+void QDeviceWatcher::setNetlinkGroup(NetlinkGroup group)
+{
+    Q_D(QDeviceWatcher);
+    d->netlink_group = group;
+}
+
+QDeviceWatcher::NetlinkGroup QDeviceWatcher::netlinkGroup() const
+{
+    return d_func()->netlink_group;
+}
+
+void QDeviceWatcher::setColdplugEnabled(bool enable)
+{
+    Q_D(QDeviceWatcher);
+    d->coldplug = enable;
+}
+
+bool QDeviceWatcher::isColdplugEnabled() const
+{
+    return d_func()->coldplug;
+}
+
+void QDeviceWatcher::setMountTrackingEnabled(bool enable)
+{
+    Q_D(QDeviceWatcher);
+    d->mount_tracking = enable;
+}
+
+bool QDeviceWatcher::isMountTrackingEnabled() const
+{
+    return d_func()->mount_tracking;
+}
+
+void QDeviceWatcher::setReaderThreadEnabled(bool enable)
+{
+    Q_D(QDeviceWatcher);
+    d->threaded = enable;
+}
+
+bool QDeviceWatcher::isReaderThreadEnabled() const
+{
+    return d_func()->threaded;
+}
+
+void QDeviceWatcher::setCoalescingWindow(int msecs)
+{
+    Q_D(QDeviceWatcher);
+    d->coalesce_window = qMax(msecs, 0);
+}
+
+int QDeviceWatcher::coalescingWindow() const
+{
+    return d_func()->coalesce_window;
+}
+
+void QDeviceWatcher::setSettleInterval(int msecs)
+{
+    Q_D(QDeviceWatcher);
+    d->settle_interval = qMax(msecs, 0);
+}
+
+int QDeviceWatcher::settleInterval() const
+{
+    return d_func()->settle_interval;
+}
+
+void QDeviceWatcher::setNetlinkSource()
+{
+#ifdef Q_OS_LINUX
+    Q_D(QDeviceWatcher);
+    d->setSource(0);
+#endif //Q_OS_LINUX
+}
+
+void QDeviceWatcher::setSourceDescriptor(int fd)
+{
+#ifdef Q_OS_LINUX
+    Q_D(QDeviceWatcher);
+    d->setSource(new QDeviceFdSource(fd));
+#else
+    Q_UNUSED(fd);
+#endif //Q_OS_LINUX
+}
+
+void QDeviceWatcher::setSourceDatagrams(const QList<QByteArray> &datagrams)
+{
+#ifdef Q_OS_LINUX
+    Q_D(QDeviceWatcher);
+    d->setSource(new QDeviceListSource(datagrams));
+#else
+    Q_UNUSED(datagrams);
+#endif //Q_OS_LINUX
+}
+
+void QDeviceWatcher::setSourceRecording(const QString &fileName, qreal speed)
+{
+#ifdef Q_OS_LINUX
+    Q_D(QDeviceWatcher);
+    d->setSource(new QDeviceReplaySource(QFile::encodeName(fileName), speed));
+#else
+    Q_UNUSED(fileName);
+    Q_UNUSED(speed);
+#endif //Q_OS_LINUX
+}
+
+void QDeviceWatcher::setRecordFile(const QString &fileName)
+{
+#ifdef Q_OS_LINUX
+    Q_D(QDeviceWatcher);
+    d->record_file = QFile::encodeName(fileName);
+#else
+    Q_UNUSED(fileName);
+#endif //Q_OS_LINUX
+}
+
+void QDeviceWatcher::setReceiveBufferSize(int minimum, int maximum)
+{
+    Q_D(QDeviceWatcher);
+    if (minimum <= 0 || maximum < minimum) {
+        qWarning("invalid receive buffer size %d..%d", minimum, maximum);
+        return;
+    }
+    d->rcvbuf_min = minimum;
+    d->rcvbuf_max = maximum;
+}
+
+int QDeviceWatcher::receiveBufferSize() const
+{
+    return d_func()->rcvbuf_size.loadRelaxed();
+}
+
+#ifndef Q_OS_LINUX
+void QDeviceWatcherPrivate::drainReader() {}
+void QDeviceWatcherPrivate::coalesceTick() {}
+void QDeviceWatcherPrivate::settleTransactions() {}
+void QDeviceWatcherPrivate::mountTableChanged() {}
+#endif //Q_OS_LINUX
+
+static bool matchField(const QList<QByteArray> &filter, const QDeviceUEventPrivate::Field &field, const char *data)
+{
+    if (filter.isEmpty())
+        return true;
+    if (field.isNull())
+        return false;
+    foreach (const QByteArray &f, filter) {
+        if (f.size() == field.size && memcmp(f.constData(), data + field.offset, field.size) == 0)
+            return true;
+    }
+    return false;
+}
+
+static bool matchTags(const QList<QByteArray> &filter, const QDeviceUEventPrivate::Field &field, const char *data)
+{
+    if (filter.isEmpty())
+        return true;
+    if (field.isNull())
+        return false;
+    //TAGS=:tag1:tag2:
+    const char *tags = data + field.offset;
+    foreach (const QByteArray &f, filter) {
+        for (int i = 0; i + f.size() + 1 < field.size; ++i) {
+            if (tags[i] == ':' && tags[i + f.size() + 1] == ':' && memcmp(tags + i + 1, f.constData(), f.size()) == 0)
+                return true;
+        }
+    }
+    return false;
+}
+
+/*!
+  Reject a udev message by the hashes in its header, without looking at the properties.
+  Hashes and bloom filter may have false positives, matchFilters() does the exact match.
+*/
+bool QDeviceWatcherPrivate::matchUdevHeader(const QDeviceUEventPrivate::UdevHeader &header) const
+{
+    if (!subsystem_hashes.isEmpty() && !subsystem_hashes.contains(qFromBigEndian<quint32>(header.filter_subsystem_hash)))
+        return false;
+    if (!devtype_hashes.isEmpty() && !devtype_hashes.contains(qFromBigEndian<quint32>(header.filter_devtype_hash)))
+        return false;
+    if (tag_blooms.isEmpty())
+        return true;
+    const quint64 bloom = (quint64(qFromBigEndian<quint32>(header.filter_tag_bloom_hi)) << 32)
+                          | qFromBigEndian<quint32>(header.filter_tag_bloom_lo);
+    foreach (quint64 tag, tag_blooms) {
+        if ((bloom & tag) == tag)
+            return true;
+    }
+    return false;
+}
+
+/*!
+  \a uevent is parsed in place from \a data, nothing is allocated here
+*/
+bool QDeviceWatcherPrivate::matchFilters(const QDeviceUEventPrivate &uevent, const char *data) const
+{
+    if (!action_filter.isEmpty() && !action_filter.contains(uevent.action))
+        return false;
+    return matchField(subsystem_filter, uevent.subsystem, data)
+           && matchField(devtype_filter, uevent.devtype, data)
+           && matchTags(tag_filter, uevent.tags, data);
+}
+
+static QMetaMethod watcherSignal(const char *signature)
+{
+    const QMetaObject &mo = QDeviceWatcher::staticMetaObject;
+    return mo.method(mo.indexOfSignal(signature));
+}
+
+void QDeviceWatcherPrivate::emitDeviceAction(const QString &dev, QDeviceUEvent::Action action)
+{
+    if (QThread::currentThread() == watcher->thread()) {
+        switch (action) {
+        case QDeviceUEvent::Add:
+            emit watcher->deviceAdded(dev);
+            break;
+        case QDeviceUEvent::Remove:
+            emit watcher->deviceRemoved(dev);
+            break;
+        case QDeviceUEvent::Change:
+            emit watcher->deviceChanged(dev);
+            break;
+        default:
+            break;
+        }
+        return;
+    }
+    static const QMetaMethod added = watcherSignal("deviceAdded(QString)");
+    static const QMetaMethod removed = watcherSignal("deviceRemoved(QString)");
+    static const QMetaMethod changed = watcherSignal("deviceChanged(QString)");
+    const QMetaMethod *method = 0;
+    switch (action) {
+    case QDeviceUEvent::Add:
+        method = &added;
+        break;
+    case QDeviceUEvent::Remove:
+        method = &removed;
+        break;
+    case QDeviceUEvent::Change:
+        method = &changed;
+        break;
+    default:
+        return;
+    }
+    if (!method->invoke(watcher, Qt::QueuedConnection, Q_ARG(QString, dev)))
+        qWarning("invoke device signal %d failed", action);
+}
+
+void QDeviceWatcherPrivate::emitDevicesChanged(const QList<QDeviceUEvent> &uevents)
+{
+    if (QThread::currentThread() == watcher->thread()) {
+        emit watcher->devicesChanged(uevents);
+        return;
+    }
+    static const QMetaMethod method = watcherSignal("devicesChanged(QList<QDeviceUEvent>)");
+    if (!method.invoke(watcher, Qt::QueuedConnection, Q_ARG(QList<QDeviceUEvent>, uevents)))
+        qWarning("invoke devicesChanged failed");
+}
+
+void QDeviceWatcherPrivate::emitEventsLost()
+{
+    if (QThread::currentThread() == watcher->thread()) {
+        emit watcher->eventsLost();
+        return;
+    }
+    static const QMetaMethod method = watcherSignal("eventsLost()");
+    if (!method.invoke(watcher, Qt::QueuedConnection))
+        qWarning("invoke eventsLost failed");
+}
+
+void QDeviceWatcherPrivate::dispatchUEvent(const QDeviceUEvent &uevent)
+{
+    const QDeviceUEvent::Action action = uevent.action();
+#ifdef Q_OS_LINUX
+    if (action == QDeviceUEvent::Remove)
+        removeDescendants(uevent); //their removal first, in the same batch
+#endif //Q_OS_LINUX
+    QElapsedTimer timer;
+    timer.start();
+    counters.events[action].fetchAndAddRelaxed(1);
+    updateRegistry(uevent);
+#ifdef Q_OS_LINUX
+    if (!uevent.d->devpath.isNull()) { //before any slot may read them
+        const bool closeDir = action == QDeviceUEvent::Add || action == QDeviceUEvent::Remove || action == QDeviceUEvent::Move;
+        attributes.invalidate(uevent.d->field(uevent.d->devpath), closeDir);
+        if (action == QDeviceUEvent::Move)
+            attributes.invalidate(uevent.property("DEVPATH_OLD"), true);
+    }
+    if (coalescer.window() > 0) {
+        counters.coalesced.fetchAndAddRelaxed(coalescer.add(uevent, &coalesce_ready));
+        if (!coalescer.isEmpty() && !coalesce_timer->isActive())
+            coalesce_timer->start(coalescer.tickInterval());
+        deliverCoalesced(); //a held event that can not be merged goes first
+        counters.dispatch_time.add(timer.nsecsElapsed());
+        return;
+    }
+#endif //Q_OS_LINUX
+    deliverUEvent(uevent);
+    counters.dispatch_time.add(timer.nsecsElapsed());
+}
+
+void QDeviceWatcherPrivate::deliverUEvent(const QDeviceUEvent &uevent)
+{
+    const QDeviceUEvent::Action action = uevent.action();
+    if (delivery & QDeviceWatcher::BatchDelivery)
+        batch.append(uevent);
+    if (uevent.d->timestamp) {
+        const qint64 latency = QDeviceUEventPrivate::currentTime() - uevent.d->timestamp;
+        if (latency >= 0) //the clock may be set back
+            counters.delivery_latency.add(latency);
+    }
+    if ((delivery & QDeviceWatcher::PerDeviceDelivery)
+        && (action == QDeviceUEvent::Add || action == QDeviceUEvent::Remove || action == QDeviceUEvent::Change)) {
+        const QString dev = uevent.devNode();
+        emitDeviceAction(dev, action);
+        postDeviceChangeEvent(uevent);
+        zDebug("%s %s %s", uevent.actionName().constData(), qPrintable(uevent.subsystem()), qPrintable(dev));
+    }
+#ifdef Q_OS_LINUX
+    if (transactions.settleInterval() > 0)
+        groupUEvent(uevent);
+#endif //Q_OS_LINUX
+}
+
+void QDeviceWatcherPrivate::postDeviceChangeEvent(const QDeviceUEvent &uevent)
 {
-    if (!QMetaObject::invokeMethod(watcher, "deviceAdded", Q_ARG(QString, dev)))
-        qWarning("invoke deviceAdded failed");
+    //Qt takes the ownership of a posted event, so every receiver gets its own. They share the payload
+    foreach (QObject *obj, event_receivers)
+        QCoreApplication::postEvent(obj, new QDeviceChangeEvent(uevent), Qt::HighEventPriority);
 }
 
-void QDeviceWatcherPrivate::emitDeviceChanged(const QString &dev)
+void QDeviceWatcherPrivate::endBatch()
 {
-    if (!QMetaObject::invokeMethod(watcher, "deviceChanged", Q_ARG(QString, dev)))
-        qWarning("invoke deviceChanged failed");
+#ifdef Q_OS_LINUX
+    if (events_lost.fetchAndStoreOrdered(0))
+        resync();
+#endif //Q_OS_LINUX
+    publishDevices();
+    if (batch.isEmpty())
+        return;
+    emitDevicesChanged(batch);
+    foreach (QObject *obj, event_receivers)
+        QCoreApplication::postEvent(obj, new QDeviceChangeBatchEvent(batch), Qt::HighEventPriority);
+    //keeps the capacity unless a receiver still shares the list. QList::clear() frees it in Qt 5
+    if (batch.isDetached())
+        batch.erase(batch.begin(), batch.end());
+    else
+        batch.clear();
 }
 
-void QDeviceWatcherPrivate::emitDeviceRemoved(const QString &dev)
+static inline bool keyEquals(const char *key, int size, const char *name, int name_size)
 {
-    if (!QMetaObject::invokeMethod(watcher, "deviceRemoved", Q_ARG(QString, dev)))
-        qWarning("invoke deviceRemoved failed");
+    return size == name_size && memcmp(key, name, size) == 0;
 }
 
-void QDeviceWatcherPrivate::emitDeviceAction(const QString &dev, const QString &action)
+static inline quint64 parseNumber(const char *s, int size)
 {
-    QString a(action.toLower());
-    if (a == QLatin1String("add"))
-        emitDeviceAdded(dev);
-    else if (a == QLatin1String("remove"))
-        emitDeviceRemoved(dev);
-    else if (a == QLatin1String("change"))
-        emitDeviceChanged(dev);
+    quint64 n = 0;
+    for (int i = 0; i < size && s[i] >= '0' && s[i] <= '9'; ++i)
+        n = n * 10 + (s[i] - '0');
+    return n;
+}
+
+qint64 QDeviceUEventPrivate::currentTime()
+{
+#ifdef Q_OS_LINUX
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#else
+    return QDateTime::currentMSecsSinceEpoch() * 1000000;
+#endif //Q_OS_LINUX
+}
+
+QDeviceUEvent::Action QDeviceUEventPrivate::actionFromName(const char *name, int size)
+{
+#define MATCH_ACTION(str, a) \
+    if (keyEquals(name, size, str, sizeof(str) - 1)) \
+        return QDeviceUEvent::a;
+    switch (size) {
+    case 3:
+        MATCH_ACTION("add", Add)
+        break;
+    case 4:
+        MATCH_ACTION("move", Move)
+        MATCH_ACTION("bind", Bind)
+        break;
+    case 6:
+        MATCH_ACTION("remove", Remove)
+        MATCH_ACTION("change", Change)
+        MATCH_ACTION("online", Online)
+        MATCH_ACTION("unbind", Unbind)
+        break;
+    case 7:
+        MATCH_ACTION("offline", Offline)
+        break;
+    default:
+        break;
+    }
+#undef MATCH_ACTION
+    return QDeviceUEvent::Unknown;
+}
+
+bool QDeviceUEventPrivate::udevHeader(const char *data, int size, UdevHeader *header)
+{
+    if (size < (int) sizeof(UdevHeader) || memcmp(data, "libudev", 8) != 0)
+        return false;
+    memcpy(header, data, sizeof(UdevHeader));
+    if (qFromBigEndian<quint32>(header->magic) != UDEV_MONITOR_MAGIC)
+        return false;
+    if (header->properties_off < sizeof(UdevHeader) || header->properties_off > (quint32) size
+        || header->properties_len > (quint32) size - header->properties_off)
+        return false;
+    return true;
+}
+
+//MurmurHash2, as udev's string_hash32()
+quint32 QDeviceUEventPrivate::hash32(const char *s, int size)
+{
+    const quint32 m = 0x5bd1e995;
+    const unsigned char *data = (const unsigned char *) s;
+    quint32 h = size;
+    while (size >= 4) {
+        quint32 k;
+        memcpy(&k, data, 4);
+        k *= m;
+        k ^= k >> 24;
+        k *= m;
+        h *= m;
+        h ^= k;
+        data += 4;
+        size -= 4;
+    }
+    switch (size) {
+    case 3:
+        h ^= data[2] << 16;
+        //fall through
+    case 2:
+        h ^= data[1] << 8;
+        //fall through
+    case 1:
+        h ^= data[0];
+        h *= m;
+    default:
+        break;
+    }
+    h ^= h >> 13;
+    h *= m;
+    h ^= h >> 15;
+    return h;
+}
+
+quint64 QDeviceUEventPrivate::bloom64(const char *s, int size)
+{
+    const quint32 hash = hash32(s, size);
+    quint64 bits = 0;
+    bits |= Q_UINT64_C(1) << (hash & 63);
+    bits |= Q_UINT64_C(1) << ((hash >> 6) & 63);
+    bits |= Q_UINT64_C(1) << ((hash >> 12) & 63);
+    bits |= Q_UINT64_C(1) << ((hash >> 18) & 63);
+    return bits;
+}
+
+/*!
+  Single pass over "action@devpath\0KEY=VALUE\0...\0", or over the property block of a
+  libudev monitor message, where ACTION and DEVPATH are properties. Nothing is copied or allocated.
+*/
+bool QDeviceUEventPrivate::parse(const char *data, int size)
+{
+    const char *end = data + size;
+    const char *eol = 0;
+    UdevHeader header;
+    if (udevHeader(data, size, &header)) {
+        properties = header.properties_off;
+        end = data + header.properties_off + header.properties_len;
+    } else {
+        eol = (const char *) memchr(data, 0, size);
+        if (!eol)
+            eol = end;
+        const char *at = (const char *) memchr(data, '@', eol - data);
+        if (!at)
+            return false;
+        action_name.offset = 0;
+        action_name.size = at - data;
+        action = actionFromName(data, action_name.size);
+        devpath.offset = at + 1 - data;
+        devpath.size = eol - at - 1;
+        properties = eol + 1 - data;
+    }
+    properties_end = end - data;
+    for (const char *p = data + properties; p < end; p = eol + 1) {
+        eol = (const char *) memchr(p, 0, end - p);
+        if (!eol)
+            eol = end;
+        const char *eq = (const char *) memchr(p, '=', eol - p);
+        if (!eq)
+            continue;
+        const int key_size = eq - p;
+        const char *value = eq + 1;
+        const int value_size = eol - value;
+#define MATCH_KEY(str) keyEquals(p, key_size, str, sizeof(str) - 1)
+#define SET_FIELD(f) \
+    f.offset = value - data; \
+    f.size = value_size;
+        switch (p[0]) {
+        case 'A':
+            if (action_name.isNull() && MATCH_KEY("ACTION")) {
+                SET_FIELD(action_name)
+                action = actionFromName(value, value_size);
+            }
+            break;
+        case 'S':
+            if (MATCH_KEY("SUBSYSTEM")) {
+                SET_FIELD(subsystem)
+            } else if (MATCH_KEY("SEQNUM")) {
+                seqnum = parseNumber(value, value_size);
+            }
+            break;
+        case 'D':
+            if (MATCH_KEY("DEVTYPE")) {
+                SET_FIELD(devtype)
+            } else if (MATCH_KEY("DEVNAME")) {
+                SET_FIELD(devname)
+            } else if (devpath.isNull() && MATCH_KEY("DEVPATH")) {
+                SET_FIELD(devpath)
+            }
+            break;
+        case 'M':
+            if (MATCH_KEY("MAJOR"))
+                dev_major = parseNumber(value, value_size);
+            else if (MATCH_KEY("MINOR"))
+                dev_minor = parseNumber(value, value_size);
+            break;
+        case 'T':
+            if (MATCH_KEY("TAGS")) {
+                SET_FIELD(tags)
+            }
+            break;
+        default:
+            break;
+        }
+#undef SET_FIELD
+#undef MATCH_KEY
+    }
+    return !action_name.isNull() && !devpath.isNull();
+}
+
+QDeviceUEventPrivate *QDeviceUEventPrivate::sharedNull()
+{
+    struct Null
+    {
+        QDeviceUEventPrivate *d;
+        Null()
+            : d(new QDeviceUEventPrivate)
+        {
+            d->ref.ref(); //held by nobody, so it never drops to 0
+        }
+    };
+    static const Null null;
+    return null.d;
+}
+
+//no block is taken from the pool, invalid events are returned by every lookup that misses
+QDeviceUEvent::QDeviceUEvent()
+    : d(QDeviceUEventPrivate::sharedNull())
+{}
+
+QDeviceUEvent::QDeviceUEvent(QDeviceUEventPrivate *dd)
+    : d(dd)
+{}
+
+QDeviceUEvent::QDeviceUEvent(Action action, const QString &devNode)
+    : d(new QDeviceUEventPrivate)
+{
+    d->action = action;
+    d->node = devNode;
+}
+
+QDeviceUEvent::QDeviceUEvent(const QDeviceUEvent &other)
+    : d(other.d)
+{}
+
+QDeviceUEvent::~QDeviceUEvent() {}
+
+QDeviceUEvent &QDeviceUEvent::operator=(const QDeviceUEvent &other)
+{
+    d = other.d;
+    return *this;
+}
+
+QDeviceUEvent QDeviceUEvent::fromRawData(const char *data, int size)
+{
+    QDeviceUEvent uevent(new QDeviceUEventPrivate);
+    if (!uevent.d->parse(data, size))
+        return QDeviceUEvent();
+    uevent.d->setRaw(data, size);
+    return uevent;
+}
+
+bool QDeviceUEvent::isValid() const
+{
+    return !d->raw.isEmpty() || !d->node.isEmpty();
+}
+
+QDeviceUEvent::Action QDeviceUEvent::action() const
+{
+    return d->action;
+}
+
+#define UEVENT_FIELD(f) \
+    (d->f.isNull() ? QByteArray() : QByteArray(d->raw.constData() + d->f.offset, d->f.size))
+#define UEVENT_STRING(f) \
+    (d->f.isNull() ? QString() : QString::fromLocal8Bit(d->raw.constData() + d->f.offset, d->f.size))
+
+QByteArray QDeviceUEvent::actionName() const
+{
+    return UEVENT_FIELD(action_name);
+}
+
+QString QDeviceUEvent::devPath() const
+{
+    return UEVENT_STRING(devpath);
+}
+
+QString QDeviceUEvent::subsystem() const
+{
+    return UEVENT_STRING(subsystem);
+}
+
+QString QDeviceUEvent::devType() const
+{
+    return UEVENT_STRING(devtype);
+}
+
+QString QDeviceUEvent::devName() const
+{
+    return UEVENT_STRING(devname);
+}
+
+QString QDeviceUEvent::devNode() const
+{
+    if (!d->node.isEmpty())
+        return d->node;
+    return d->nodeName();
+}
+
+QString QDeviceUEventPrivate::nodeName() const
+{
+    if (!devname.isNull()) {
+        const char *name = raw.constData() + devname.offset;
+        if (devname.size > 0 && name[0] == '/')
+            return QString::fromLocal8Bit(name, devname.size);
+        return QLatin1String("/dev/") + QString::fromLocal8Bit(name, devname.size);
+    }
+    if (devpath.isNull())
+        return QString();
+    //no DEVNAME (old kernels or devices without a node): use the last component of the devpath
+    const char *path = raw.constData() + devpath.offset;
+    int i = devpath.size;
+    while (i > 0 && path[i - 1] != '/')
+        --i;
+    return QLatin1String("/dev/") + QString::fromLocal8Bit(path + i, devpath.size - i);
+}
+
+#undef UEVENT_FIELD
+#undef UEVENT_STRING
+
+quint64 QDeviceUEvent::deviceNumber() const
+{
+    if (d->dev_major == 0 && d->dev_minor == 0)
+        return 0;
+#ifdef Q_OS_LINUX
+    return makedev(d->dev_major, d->dev_minor);
+#else
+    return (quint64(d->dev_major) << 32) | quint32(d->dev_minor);
+#endif //Q_OS_LINUX
+}
+
+int QDeviceUEvent::majorNumber() const
+{
+    return d->dev_major;
+}
+
+int QDeviceUEvent::minorNumber() const
+{
+    return d->dev_minor;
+}
+
+quint64 QDeviceUEvent::seqNum() const
+{
+    return d->seqnum;
+}
+
+qint64 QDeviceUEvent::timestamp() const
+{
+    return d->timestamp;
+}
+
+QByteArray QDeviceUEvent::property(const char *key) const
+{
+    const int key_size = strlen(key);
+    const char *data = d->raw.constData();
+    const char *end = data + d->properties_end;
+    for (const char *p = data + d->properties; p < end;) {
+        const char *eol = (const char *) memchr(p, 0, end - p);
+        if (!eol)
+            eol = end;
+        if (eol - p > key_size && p[key_size] == '=' && memcmp(p, key, key_size) == 0)
+            return QByteArray(p + key_size + 1, eol - p - key_size - 1);
+        p = eol + 1;
+    }
+    return QByteArray();
+}
+
+QList<QByteArray> QDeviceUEvent::propertyKeys() const
+{
+    QList<QByteArray> keys;
+    const char *data = d->raw.constData();
+    const char *end = data + d->properties_end;
+    for (const char *p = data + d->properties; p < end;) {
+        const char *eol = (const char *) memchr(p, 0, end - p);
+        if (!eol)
+            eol = end;
+        const char *eq = (const char *) memchr(p, '=', eol - p);
+        if (eq)
+            keys.append(QByteArray(p, eq - p));
+        p = eol + 1;
+    }
+    return keys;
+}
+
+QByteArray QDeviceUEvent::rawData() const
+{
+    //an inline datagram lives in the pooled block, which is recycled with the last copy
+    if (d->isInline())
+        return QByteArray(d->raw.constData(), d->raw.size());
+    return d->raw;
+}
+
+void QDeviceRegistry::update(const QDeviceUEvent &uevent)
+{
+    const QDeviceUEventPrivate *d = uevent.d.constData();
+    if (d->devpath.isNull())
+        return;
+    if (d->action == QDeviceUEvent::Move) {
+        const int i = by_devpath.value(uevent.property("DEVPATH_OLD"), -1);
+        if (i >= 0)
+            removeAt(i);
+    }
+    const int i = by_devpath.value(d->field(d->devpath), -1);
+    if (i >= 0 && d->action != QDeviceUEvent::Remove && sameKeys(list.at(i).d.constData(), d)) {
+        list[i] = uevent; //e.g. change, the indexes stay as they are
+        return;
+    }
+    if (i >= 0)
+        removeAt(i);
+    if (d->action != QDeviceUEvent::Remove)
+        insert(uevent);
+}
+
+bool QDeviceRegistry::sameKeys(const QDeviceUEventPrivate *a, const QDeviceUEventPrivate *b)
+{
+    if (a->dev_major != b->dev_major || a->dev_minor != b->dev_minor || a->devname.size != b->devname.size)
+        return false;
+    return a->devname.isNull()
+        || memcmp(a->raw.constData() + a->devname.offset, b->raw.constData() + b->devname.offset, a->devname.size) == 0;
+}
+
+void QDeviceRegistry::assign(const QDeviceRegistry &other)
+{
+    list.clear(); //keeps the capacity
+    list.reserve(other.list.size());
+    foreach (const QDeviceUEvent &uevent, other.list)
+        list.append(uevent);
+    by_devpath = other.by_devpath;
+    by_node = other.by_node;
+    by_devnum = other.by_devnum;
+    tree = other.tree;
+    first_root = other.first_root;
+    below = other.below;
+}
+
+void QDeviceRegistry::clear()
+{
+    list.clear();
+    by_devpath.clear();
+    by_node.clear();
+    by_devnum.clear();
+    tree.clear();
+    first_root = -1;
+    below.clear();
+}
+
+int QDeviceRegistry::indexOf(const QString &devPathOrNode) const
+{
+    const int i = by_devpath.value(devPathOrNode.toLocal8Bit(), -1);
+    if (i >= 0)
+        return i;
+    return by_node.value(devPathOrNode, -1);
+}
+
+int QDeviceRegistry::indexOf(quint64 devNum) const
+{
+    return by_devnum.value(devNum, -1);
+}
+
+void QDeviceRegistry::insert(const QDeviceUEvent &uevent)
+{
+    const QDeviceUEventPrivate *d = uevent.d.constData();
+    const int i = list.size();
+    list.append(uevent);
+    const char *path = d->raw.constData() + d->devpath.offset;
+    const int size = d->devpath.size;
+    const Node node = {-1, -1, -1, -1};
+    tree.append(node);
+    const int parent = nearestAncestor(path, size);
+    //children of the parent that are below the new device, e.g. coldplug in any order. Usually
+    //there are none, and the siblings (all roots for class devices) are not visited
+    int left = below.value(QByteArray::fromRawData(path, size), 0);
+    for (int c = parent < 0 ? first_root : tree.at(parent).first_child; c >= 0 && left > 0;) {
+        const int next = tree.at(c).next;
+        const QDeviceUEventPrivate *child = list.at(c).d.constData();
+        const char *child_path = child->raw.constData() + child->devpath.offset;
+        if (isDevPathAncestor(path, size, child_path, child->devpath.size)) {
+            unlink(c);
+            link(c, i);
+            left -= 1 + below.value(QByteArray::fromRawData(child_path, child->devpath.size), 0);
+        }
+        c = next;
+    }
+    link(i, parent);
+    countBelow(path, size, 1);
+    //deep copy: the key must not point into the event's raw data
+    by_devpath.insert(QByteArray(path, size), i);
+    if (!d->devname.isNull())
+        by_node.insert(uevent.devNode(), i);
+    if (uevent.deviceNumber())
+        by_devnum.insert(uevent.deviceNumber(), i);
+}
+
+void QDeviceRegistry::countBelow(const char *path, int size, int delta)
+{
+    for (int n = size; n > 0;) {
+        while (n > 0 && path[n - 1] != '/')
+            --n;
+        if (--n <= 0)
+            break;
+        QHash<QByteArray, int>::iterator it = below.find(QByteArray::fromRawData(path, n));
+        if (it == below.end())
+            below.insert(QByteArray(path, n), delta); //deep copy
+        else if ((it.value() += delta) == 0)
+            below.erase(it);
+    }
+}
+
+int QDeviceRegistry::nearestAncestor(const char *path, int size) const
+{
+    for (int n = size; n > 0;) {
+        while (n > 0 && path[n - 1] != '/')
+            --n;
+        if (--n <= 0)
+            break;
+        const int i = by_devpath.value(QByteArray::fromRawData(path, n), -1);
+        if (i >= 0)
+            return i;
+    }
+    return -1;
+}
+
+void QDeviceRegistry::link(int index, int parent)
+{
+    int &head = parent < 0 ? first_root : tree[parent].first_child;
+    Node &node = tree[index];
+    node.parent = parent;
+    node.prev = -1;
+    node.next = head;
+    if (head >= 0)
+        tree[head].prev = index;
+    head = index;
+}
+
+void QDeviceRegistry::unlink(int index)
+{
+    Node &node = tree[index];
+    if (node.prev >= 0)
+        tree[node.prev].next = node.next;
+    else if (node.parent >= 0)
+        tree[node.parent].first_child = node.next;
+    else
+        first_root = node.next;
+    if (node.next >= 0)
+        tree[node.next].prev = node.prev;
+    node.parent = node.prev = node.next = -1;
+}
+
+QVector<int> QDeviceRegistry::childrenOf(int index) const
+{
+    QVector<int> children;
+    for (int c = tree.at(index).first_child; c >= 0; c = tree.at(c).next)
+        children.append(c);
+    return children;
+}
+
+QVector<int> QDeviceRegistry::descendantsOf(int index) const
+{
+    QVector<int> descendants;
+    int c = tree.at(index).first_child;
+    while (c >= 0) {
+        descendants.append(c);
+        if (tree.at(c).first_child >= 0) {
+            c = tree.at(c).first_child;
+            continue;
+        }
+        while (c != index && tree.at(c).next < 0)
+            c = tree.at(c).parent;
+        if (c == index)
+            break;
+        c = tree.at(c).next;
+    }
+    return descendants;
+}
+
+void QDeviceRegistry::removeAt(int index)
+{
+    const QDeviceUEvent &uevent = list.at(index);
+    by_devpath.remove(uevent.d->field(uevent.d->devpath));
+    countBelow(uevent.d->raw.constData() + uevent.d->devpath.offset, uevent.d->devpath.size, -1);
+    if (!uevent.d->devname.isNull())
+        by_node.remove(uevent.devNode());
+    if (uevent.deviceNumber())
+        by_devnum.remove(uevent.deviceNumber());
+    const int parent = tree.at(index).parent;
+    for (int c = tree.at(index).first_child; c >= 0;) {
+        const int next = tree.at(c).next;
+        unlink(c);
+        link(c, parent);
+        c = next;
+    }
+    unlink(index);
+    const int last = list.size() - 1;
+    if (index != last) { //move the last one into the hole
+        list[index] = list.at(last);
+        const QDeviceUEvent &moved = list.at(index);
+        by_devpath[moved.d->field(moved.d->devpath)] = index;
+        if (!moved.d->devname.isNull())
+            by_node[moved.devNode()] = index;
+        if (moved.deviceNumber())
+            by_devnum[moved.deviceNumber()] = index;
+        tree[index] = tree.at(last);
+        const Node &node = tree.at(index);
+        if (node.prev >= 0)
+            tree[node.prev].next = index;
+        else if (node.parent >= 0)
+            tree[node.parent].first_child = index;
+        else
+            first_root = index;
+        if (node.next >= 0)
+            tree[node.next].prev = index;
+        for (int c = node.first_child; c >= 0; c = tree.at(c).next)
+            tree[c].parent = index;
+    }
+    list.removeLast();
+    tree.removeLast();
+}
+
+QDeviceSnapshotPublisher::QDeviceSnapshotPublisher()
+    : current(new QDeviceSnapshotPrivate)
+    , epoch(0)
+    , generation(0)
+    , spare(0)
+{
+    current.loadRelaxed()->ref.ref(); //owned by the publisher
+}
+
+QDeviceSnapshotPublisher::~QDeviceSnapshotPublisher()
+{
+    QDeviceSnapshotPrivate *d = current.loadAcquire();
+    if (!d->ref.deref())
+        delete d;
+    delete spare;
+}
+
+void QDeviceSnapshotPublisher::publish(const QDeviceRegistry &registry)
+{
+    QDeviceSnapshotPrivate *d = spare ? spare : new QDeviceSnapshotPrivate;
+    spare = 0;
+    d->registry.assign(registry);
+    d->generation = ++generation;
+    d->ref.ref();
+    QDeviceSnapshotPrivate *old = current.fetchAndStoreOrdered(d);
+    const int e = epoch.fetchAndAddOrdered(1) & 1;
+    //store-load: the flip must be visible before readers[e] is read, acq_rel does not order that
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    //readers registered in the old epoch may have loaded old without a reference yet
+    while (readers[e].loadAcquire() != 0)
+        QThread::yieldCurrentThread();
+    if (old->ref.deref())
+        return;
+    //nobody can reach old any more, keep it without the devices it references
+    old->registry.clear();
+    spare = old;
+}
+
+QDeviceSnapshot QDeviceSnapshotPublisher::acquire() const
+{
+    for (;;) {
+        const int e = epoch.loadAcquire() & 1;
+        readers[e].fetchAndAddOrdered(1);
+        //store-load: the registration must be visible before epoch and current are read again
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if ((epoch.loadAcquire() & 1) != e) { //a writer flipped in between, it may not wait for us
+            readers[e].fetchAndAddOrdered(-1);
+            continue;
+        }
+        QDeviceSnapshot snapshot(current.loadAcquire()); //takes a reference
+        readers[e].fetchAndAddOrdered(-1);
+        return snapshot;
+    }
+}
+
+QDeviceSnapshot::QDeviceSnapshot()
+    : d(new QDeviceSnapshotPrivate)
+{}
+
+QDeviceSnapshot::QDeviceSnapshot(QDeviceSnapshotPrivate *dd)
+    : d(dd)
+{}
+
+QDeviceSnapshot::QDeviceSnapshot(const QDeviceSnapshot &other)
+    : d(other.d)
+{}
+
+QDeviceSnapshot::~QDeviceSnapshot() {}
+
+QDeviceSnapshot &QDeviceSnapshot::operator=(const QDeviceSnapshot &other)
+{
+    d = other.d;
+    return *this;
+}
+
+quint64 QDeviceSnapshot::generation() const
+{
+    return d->generation;
+}
+
+int QDeviceSnapshot::size() const
+{
+    return d->registry.devices().size();
+}
+
+QList<QDeviceUEvent> QDeviceSnapshot::devices() const
+{
+    const QVector<QDeviceUEvent> &list = d->registry.devices();
+    QList<QDeviceUEvent> devices;
+    devices.reserve(list.size());
+    foreach (const QDeviceUEvent &uevent, list)
+        devices.append(uevent);
+    return devices;
+}
+
+QDeviceUEvent QDeviceSnapshot::device(quint64 devNum) const
+{
+    const int i = d->registry.indexOf(devNum);
+    return i < 0 ? QDeviceUEvent() : d->registry.devices().at(i);
+}
+
+QDeviceUEvent QDeviceSnapshot::device(const QString &devPathOrNode) const
+{
+    const int i = d->registry.indexOf(devPathOrNode);
+    return i < 0 ? QDeviceUEvent() : d->registry.devices().at(i);
+}
+
+bool QDeviceSnapshot::contains(quint64 devNum) const
+{
+    return d->registry.indexOf(devNum) >= 0;
+}
+
+bool QDeviceSnapshot::contains(const QString &devPathOrNode) const
+{
+    return d->registry.indexOf(devPathOrNode) >= 0;
+}
+
+QDeviceUEvent QDeviceSnapshot::parent(const QString &devPathOrNode) const
+{
+    const int i = d->registry.indexOf(devPathOrNode);
+    const int p = i < 0 ? -1 : d->registry.parentOf(i);
+    return p < 0 ? QDeviceUEvent() : d->registry.devices().at(p);
+}
+
+QList<QDeviceUEvent> QDeviceSnapshot::ancestors(const QString &devPathOrNode) const
+{
+    QList<QDeviceUEvent> ancestors;
+    const int i = d->registry.indexOf(devPathOrNode);
+    for (int p = i < 0 ? -1 : d->registry.parentOf(i); p >= 0; p = d->registry.parentOf(p))
+        ancestors.append(d->registry.devices().at(p));
+    return ancestors;
+}
+
+QList<QDeviceUEvent> QDeviceSnapshot::children(const QString &devPathOrNode) const
+{
+    QList<QDeviceUEvent> children;
+    const int i = d->registry.indexOf(devPathOrNode);
+    if (i >= 0) {
+        foreach (int c, d->registry.childrenOf(i))
+            children.append(d->registry.devices().at(c));
+    }
+    return children;
+}
+
+QList<QDeviceUEvent> QDeviceSnapshot::descendants(const QString &devPathOrNode) const
+{
+    QList<QDeviceUEvent> descendants;
+    const int i = d->registry.indexOf(devPathOrNode);
+    if (i >= 0) {
+        foreach (int c, d->registry.descendantsOf(i))
+            descendants.append(d->registry.devices().at(c));
+    }
+    return descendants;
+}
+
+/*!
+  Recycled memory blocks of one size, for QDeviceChangeEvent and QDeviceUEventPrivate. They
+  are created in the watcher's thread and deleted in the receivers' threads, possibly after
+  the watcher is gone, so the pools are shared and locked. At most max_free blocks are kept.
+*/
+class QDeviceBlockPool
+{
+public:
+    explicit QDeviceBlockPool(int maxFree)
+        : free_list(0)
+        , free_count(0)
+        , max_free(maxFree)
+    {}
+    ~QDeviceBlockPool()
+    {
+        while (free_list) {
+            Block *b = free_list;
+            free_list = b->next;
+            ::operator delete(b);
+        }
+    }
+    void *allocate()
+    {
+        QMutexLocker lock(&mutex);
+        Block *b = free_list;
+        if (b) {
+            free_list = b->next;
+            --free_count;
+        }
+        return b;
+    }
+    bool release(void *ptr)
+    {
+        QMutexLocker lock(&mutex);
+        if (free_count >= max_free)
+            return false;
+        Block *b = static_cast<Block *>(ptr);
+        b->next = free_list;
+        free_list = b;
+        ++free_count;
+        return true;
+    }
+
+private:
+    struct Block
+    {
+        Block *next;
+    };
+    QMutex mutex;
+    Block *free_list;
+    int free_count;
+    int max_free;
+};
+Q_GLOBAL_STATIC_WITH_ARGS(QDeviceBlockPool, eventPool, (256))
+//events queued in the reader's ring or a batch are alive at once, 2 MB of free blocks at most
+Q_GLOBAL_STATIC_WITH_ARGS(QDeviceBlockPool, ueventPool, (1024))
+
+QDeviceUEventPrivate::QDeviceUEventPrivate(const QDeviceUEventPrivate &other)
+    : QSharedData(other)
+    , node(other.node)
+    , action(other.action)
+    , action_name(other.action_name)
+    , devpath(other.devpath)
+    , subsystem(other.subsystem)
+    , devtype(other.devtype)
+    , devname(other.devname)
+    , tags(other.tags)
+    , properties(other.properties)
+    , properties_end(other.properties_end)
+    , dev_major(other.dev_major)
+    , dev_minor(other.dev_minor)
+    , seqnum(other.seqnum)
+    , timestamp(other.timestamp)
+{
+    //raw of other must not be referenced, it goes away with other's block
+    if (other.isInline())
+        setRaw(other.raw.constData(), other.raw.size());
+    else
+        raw = other.raw;
+}
+
+void *QDeviceUEventPrivate::operator new(size_t size)
+{
+    if (size == sizeof(QDeviceUEventPrivate)) {
+        QDeviceBlockPool *pool = ueventPool();
+        void *ptr = pool ? pool->allocate() : 0;
+        return ptr ? ptr : ::operator new(size + InlineSize);
+    }
+    return ::operator new(size);
+}
+
+void QDeviceUEventPrivate::operator delete(void *ptr, size_t size)
+{
+    if (ptr && size == sizeof(QDeviceUEventPrivate)) {
+        QDeviceBlockPool *pool = ueventPool(); //null after the pool is destroyed at exit
+        if (pool && pool->release(ptr))
+            return;
+    }
+    ::operator delete(ptr);
+}
+
+void QDeviceUEventPrivate::setRaw(const char *data, int size)
+{
+    if (size > InlineSize) {
+        raw = QByteArray(data, size);
+        return;
+    }
+    char *storage = reinterpret_cast<char *>(this + 1);
+    memcpy(storage, data, size);
+    //no allocation with Qt 6, Qt 5 allocates a header unless raw already is raw data
+    raw.setRawData(storage, size);
+}
+
+void *QDeviceChangeEvent::operator new(size_t size)
+{
+    if (size == sizeof(QDeviceChangeEvent)) { //not a subclass
+        QDeviceBlockPool *pool = eventPool();
+        void *ptr = pool ? pool->allocate() : 0;
+        if (ptr)
+            return ptr;
+    }
+    return ::operator new(size);
+}
+
+void QDeviceChangeEvent::operator delete(void *ptr, size_t size)
+{
+    if (ptr && size == sizeof(QDeviceChangeEvent)) {
+        QDeviceBlockPool *pool = eventPool(); //null after the pool is destroyed at exit
+        if (pool && pool->release(ptr))
+            return;
+    }
+    ::operator delete(ptr);
 }
 
 //const QEvent::Type  QDeviceChangeEvent::EventType = static_cast<QEvent::Type>(QEvent::registerEventType());
 QDeviceChangeEvent::QDeviceChangeEvent(Action action, const QString &device)
     : QEvent(registeredType())
-{
-    m_action = action;
-    m_device = device;
-}
+    , m_action(action)
+    , m_device(device)
+    , m_uevent(static_cast<QDeviceUEvent::Action>(action), device)
+{}
+
+QDeviceChangeBatchEvent::QDeviceChangeBatchEvent(const QList<QDeviceUEvent> &uevents)
+    : QEvent(registeredType())
+    , m_uevents(uevents)
+{}
+
+QDeviceChangeEvent::QDeviceChangeEvent(const QDeviceUEvent &uevent)
+    : QEvent(registeredType())
+    , m_action(static_cast<Action>(uevent.action()))
+    , m_device(uevent.devNode())
+    , m_uevent(uevent)
+{}
@@ -20,8 +20,14 @@
 #ifndef QDEVICEWATCHER_H
 #define QDEVICEWATCHER_H
 
+#include <QtCore/QByteArray>
 #include <QtCore/QEvent>
+#include <QtCore/QList>
+#include <QtCore/QMetaType>
 #include <QtCore/QObject>
+#include <QtCore/QSharedDataPointer>
+#include <QtCore/QString>
+#include <QtCore/QStringList>
 
 #ifdef BUILD_QDEVICEWATCHER_STATIC
 #define Q_DW_EXPORT
@@ -36,12 +42,140 @@
 #endif //BUILD_QDEVICEWATCHER_STATIC
 
 class QDeviceWatcherPrivate;
+class QDeviceUEventPrivate;
+class QDeviceSnapshotPrivate;
+
+/*!
+  A structured kernel uevent. The raw datagram is kept once and shared between copies,
+  the fields and the KEY=VALUE properties are views into it.
+  On platforms other than Linux only action() and devNode() are filled.
+*/
+class Q_DW_EXPORT QDeviceUEvent
+{
+public:
+    //the first 3 values are the same as QDeviceChangeEvent::Action
+    enum Action { Add, Remove, Change, Move, Online, Offline, Bind, Unbind, Unknown };
+
+    QDeviceUEvent();
+    QDeviceUEvent(Action action, const QString &devNode);
+    QDeviceUEvent(const QDeviceUEvent &other);
+    ~QDeviceUEvent();
+    QDeviceUEvent &operator=(const QDeviceUEvent &other);
+
+    //parse a "action@devpath\0KEY=VALUE\0..." kernel or a libudev monitor datagram. The data is copied once
+    static QDeviceUEvent fromRawData(const char *data, int size);
+
+    bool isValid() const;
+    Action action() const;
+    QByteArray actionName() const;
+    QString devPath() const;
+    QString subsystem() const;
+    QString devType() const;
+    QString devName() const; //DEVNAME, e.g. "sdb1" or "bus/usb/001/005". udev sends "/dev/sdb1"
+    //"/dev/" + DEVNAME, or the last devpath component if no DEVNAME. On Linux the nodes of events
+    //from a watcher share their data while the device exists, constData() identifies the device
+    QString devNode() const;
+    quint64 deviceNumber() const; //dev_t, 0 if the device has no node
+    int majorNumber() const;
+    int minorNumber() const;
+    quint64 seqNum() const;
+    //Linux: kernel receive time of the datagram in ns since the epoch, 0 if unknown (e.g. coldplug)
+    qint64 timestamp() const;
+
+    QByteArray property(const char *key) const;
+    QList<QByteArray> propertyKeys() const;
+    QByteArray rawData() const;
+
+private:
+    friend class QDeviceWatcherPrivate;
+    friend class QDeviceRegistry;
+    friend class QDeviceCoalescer;
+    friend class QDeviceTransactions;
+    explicit QDeviceUEvent(QDeviceUEventPrivate *dd);
+    QSharedDataPointer<QDeviceUEventPrivate> d;
+};
+Q_DECLARE_TYPEINFO(QDeviceUEvent, Q_MOVABLE_TYPE); //stored in place in a QList
+
+
+/*!
+  An immutable view of the known devices at one point in time. Obtaining and reading
+  a snapshot is thread safe and lock free, the watcher publishes a new generation after
+  each batch of events instead of modifying the one readers hold.
+*/
+class Q_DW_EXPORT QDeviceSnapshot
+{
+public:
+    QDeviceSnapshot();
+    QDeviceSnapshot(const QDeviceSnapshot &other);
+    ~QDeviceSnapshot();
+    QDeviceSnapshot &operator=(const QDeviceSnapshot &other);
+
+    quint64 generation() const;
+    int size() const;
+    QList<QDeviceUEvent> devices() const;
+    QDeviceUEvent device(quint64 devNum) const;
+    QDeviceUEvent device(const QString &devPathOrNode) const;
+    bool contains(quint64 devNum) const;
+    bool contains(const QString &devPathOrNode) const;
+    //see QDeviceWatcher::parent()
+    QDeviceUEvent parent(const QString &devPathOrNode) const;
+    QList<QDeviceUEvent> ancestors(const QString &devPathOrNode) const;
+    QList<QDeviceUEvent> children(const QString &devPathOrNode) const;
+    QList<QDeviceUEvent> descendants(const QString &devPathOrNode) const;
+
+private:
+    friend class QDeviceSnapshotPublisher;
+    explicit QDeviceSnapshot(QDeviceSnapshotPrivate *dd);
+    QExplicitlySharedDataPointer<QDeviceSnapshotPrivate> d;
+};
+Q_DECLARE_TYPEINFO(QDeviceSnapshot, Q_MOVABLE_TYPE);
+
+/*!
+  Counters of a watcher since it was created, see QDeviceWatcher::statistics(). Every value is
+  read on its own, so they can be slightly inconsistent with each other while events arrive.
+  Histograms count durations in nanoseconds, bucket i holds [2^i, 2^(i+1)), bucket 0 also 0.
+*/
+struct Q_DW_EXPORT QDeviceWatcherStatistics
+{
+    enum { HistogramBuckets = 32 };
+    QDeviceWatcherStatistics();
+
+    quint64 datagrams; //received from the socket
+    quint64 bytes;
+    quint64 events[QDeviceUEvent::Unknown + 1]; //dispatched, by QDeviceUEvent::Action
+    quint64 filtered;     //parsed and dropped by the filters
+    quint64 overflows;    //receive queue overflows
+    quint64 missedEvents; //counted from SEQNUM gaps and truncated messages
+    quint64 coalesced;    //merged into another event or cancelled, see setCoalescingWindow()
+    int queueDepth;       //parsed by the reader thread and not dispatched yet
+    int queueHighWater;
+    int receiveBufferSize;
+    int receiveBufferHighWater; //most kernel memory seen queued at once
+    quint64 parseTime[HistogramBuckets];
+    quint64 dispatchTime[HistogramBuckets]; //including directly connected slots
+    //from the kernel receive timestamp to parsed, i.e. the time spent in the socket queue
+    quint64 receiveLatency[HistogramBuckets];
+    //from the kernel receive timestamp to signals emitted and events posted in the watcher's thread
+    quint64 deliveryLatency[HistogramBuckets];
+};
 
 class Q_DW_EXPORT QDeviceWatcher : public QObject
 {
     Q_OBJECT
     Q_DECLARE_PRIVATE(QDeviceWatcher)
 public:
+    /*!
+      Linux netlink multicast groups. KernelGroup events arrive before udev has processed
+      the device, UdevGroup events after udev has created the device nodes and symlinks.
+    */
+    enum NetlinkGroup { KernelGroup = 1, UdevGroup = 2 };
+    /*!
+      PerDeviceDelivery: deviceAdded/Changed/Removed and a QDeviceChangeEvent per device.
+      BatchDelivery: devicesChanged() and a QDeviceChangeBatchEvent once per received batch.
+    */
+    enum DeliveryFlag { PerDeviceDelivery = 0x1, BatchDelivery = 0x2 };
+    Q_DECLARE_FLAGS(DeliveryFlags, DeliveryFlag)
+
     explicit QDeviceWatcher(QObject *parent = 0);
     ~QDeviceWatcher();
 
@@ -51,10 +185,157 @@ public:
 
     void appendEventReceiver(QObject *receiver);
 
+    /*!
+      Linux: only report uevents matching all filters. An empty list matches everything.
+      Actions are dropped in the kernel by a socket filter, subsystems and devtypes are
+      matched before the event is copied or dispatched. While the reader thread is running
+      the filters can not be changed, stop() first.
+    */
+    void setActionFilter(const QList<QDeviceUEvent::Action> &actions);
+    void setSubsystemFilter(const QStringList &subsystems);
+    void setDevTypeFilter(const QStringList &devTypes);
+    //UdevGroup only. Matches any of the udev tags
+    void setTagFilter(const QStringList &tags);
+    /*!
+      Linux: where uevents come from, takes effect on next start(). The default is a netlink
+      socket of netlinkGroup(). setSourceDescriptor() reads an open descriptor instead, which
+      is made non-blocking and is not closed: a datagram socket (e.g. socketpair()) carries a
+      uevent per datagram, a stream (pipe, file) the records of a setRecordFile() log: a 32 bit
+      size and a 64 bit time, both little endian, followed by the datagram. The log's magic is
+      optional, so a log can be read as fast as possible. setSourceDatagrams() feeds the
+      datagrams through the event loop in batches. Either way the events are parsed, filtered
+      and delivered as from netlink.
+    */
+    void setNetlinkSource();
+    void setSourceDescriptor(int fd);
+    void setSourceDatagrams(const QList<QByteArray> &datagrams);
+    /*!
+      Linux: replay a log written by setRecordFile(). speed 1.0 keeps the original timing,
+      2.0 is twice as fast, 0 is as fast as possible. Takes effect on next start()
+    */
+    void setSourceRecording(const QString &fileName, qreal speed = 1.0);
+    /*!
+      Linux: append every received datagram with its receive time to fileName, from next
+      start() until stop(). Filters do not apply, the log holds the stream as received.
+      An empty name stops recording.
+    */
+    void setRecordFile(const QString &fileName);
+    //Linux: takes effect on next start()
+    void setNetlinkGroup(NetlinkGroup group);
+    NetlinkGroup netlinkGroup() const;
+    /*!
+      Linux: report devices already present as "add" events when started. Subsystems in the
+      subsystem filter are scanned, all buses and classes if the filter is empty. Events
+      happening during the scan are queued and reported after it.
+    */
+    void setColdplugEnabled(bool enable);
+    bool isColdplugEnabled() const;
+    /*!
+      Linux: mounting and unmounting do not produce uevents. Watch /proc/self/mountinfo in the
+      watcher's event loop and emit deviceMounted() and deviceUnmounted() for known devices.
+      The kernel wakes the loop when the mount table changes, it is read only then. File
+      systems reporting an anonymous device, e.g. btrfs, are matched by their source device
+      node. Takes effect on next start()
+    */
+    void setMountTrackingEnabled(bool enable);
+    bool isMountTrackingEnabled() const;
+    /*!
+      Linux: receive and parse uevents in a dedicated thread instead of the watcher's event
+      loop. Signals and events are still delivered in the watcher's thread, once per batch.
+      The filters can not be changed until stop(). Takes effect on next start()
+    */
+    void setReaderThreadEnabled(bool enable);
+    bool isReaderThreadEnabled() const;
+    /*!
+      Linux: bounds of the netlink receive buffer. It starts at minimum, grows up to maximum
+      when a burst fills half of it or events are lost and shrinks back when it is quiet.
+      minimum == maximum is a fixed size. Default is 128 KB to 16 MB. Without CAP_NET_ADMIN the
+      kernel limits it to net.core.rmem_max. Takes effect on next start()
+    */
+    void setReceiveBufferSize(int minimum, int maximum);
+    //Linux: receive buffer granted by the kernel, including its bookkeeping. 0 if not running
+    int receiveBufferSize() const;
+    /*!
+      Linux: hold the notifications of a device for msecs and merge the ones that follow within
+      that time: add and change is reported as add, add and remove cancel out, changes collapse
+      into the last one. Other combinations are reported in order. The registry is updated
+      without delay. 0 (default) reports every event at once. Takes effect on next start()
+    */
+    void setCoalescingWindow(int msecs);
+    int coalescingWindow() const;
+    /*!
+      Linux: group the events of one physical device by devpath ancestry, e.g. the usb_device,
+      its interfaces, the scsi host, target and device, the disk and its partitions of a USB
+      stick, and report them once with deviceArrived() or deviceDeparted() after none of them
+      had an event for msecs. A device removed again before it settled is reported by neither.
+      The per-event signals are still emitted. 0 (default) disables. Takes effect on next start()
+    */
+    void setSettleInterval(int msecs);
+    int settleInterval() const;
+    //default is PerDeviceDelivery | BatchDelivery
+    void setDelivery(DeliveryFlags flags);
+    DeliveryFlags delivery() const;
+
+    /*!
+      Linux: devices known from the reported events (and coldplug), matching the filters.
+      devPathOrNode is a devpath "/devices/..." or a device node "/dev/sdb1".
+      device() returns an invalid QDeviceUEvent if not found.
+      These functions can be called from any thread. Use snapshot() to query several
+      times in a consistent state.
+    */
+    QDeviceSnapshot snapshot() const;
+    QList<QDeviceUEvent> devices() const;
+    //can be called from any thread. Counting is always on, it costs a few relaxed atomic adds per event
+    QDeviceWatcherStatistics statistics() const;
+    QDeviceUEvent device(quint64 devNum) const;
+    QDeviceUEvent device(const QString &devPathOrNode) const;
+    bool contains(quint64 devNum) const;
+    bool contains(const QString &devPathOrNode) const;
+    /*!
+      Linux: the topology of the known devices by devpath ancestry, e.g. the disk of a partition
+      and the usb_device above it. Devices not reported are skipped. Coldplug without a
+      subsystem filter reports every device of a bus or a class, which is the whole tree but
+      for sysfs directories of neither, e.g. glue directories; a subsystem filter limits it.
+      parent() is invalid for a topmost device, ancestors() starts at the parent, descendants()
+      lists every device before its children. Removing a device that still has known
+      descendants reports their removal first, in the same batch.
+    */
+    QDeviceUEvent parent(const QString &devPathOrNode) const;
+    QList<QDeviceUEvent> ancestors(const QString &devPathOrNode) const;
+    QList<QDeviceUEvent> children(const QString &devPathOrNode) const;
+    QList<QDeviceUEvent> descendants(const QString &devPathOrNode) const;
+    /*!
+      Linux: a sysfs attribute of a known device without the trailing newline, e.g. "size",
+      "removable", "device/model" or "queue/rotational". Null if the device is not known or
+      has no such attribute. Read on first access with openat() relative to the directory of
+      the device, which is opened once, then cached until the next event of the device, so
+      slots connected to the signals see fresh values. Can be called from any thread.
+    */
+    QByteArray attribute(const QString &devPathOrNode, const QByteArray &name) const;
+    //Linux: where a known device is mounted, see setMountTrackingEnabled(). Can be called from any thread
+    QStringList mountPoints(const QString &devPathOrNode) const;
+
 signals:
     void deviceAdded(const QString &dev);
-    void deviceChanged(const QString &dev); //when umounting the device
+    void deviceChanged(const QString &dev); //e.g. media change. Linux: not on (un)mount, see deviceMounted()
     void deviceRemoved(const QString &dev);
+    //Linux: all events of one receive cycle that passed the filters, any action, in order
+    void devicesChanged(const QList<QDeviceUEvent> &uevents);
+    /*!
+      Linux: uevents were lost, the receive queue overflowed, a message was truncated or
+      SEQNUM skipped (KernelGroup only, udevd does not deliver in order). Followed by the
+      removals (and additions if coldplug is enabled) missed meanwhile, found in sysfs.
+    */
+    void eventsLost();
+    /*!
+      Linux: a physical device appeared or disappeared, see setSettleInterval(). devPath is the
+      topmost devpath of the group, members are its events in the order they were received.
+    */
+    void deviceArrived(const QString &devPath, const QList<QDeviceUEvent> &members);
+    void deviceDeparted(const QString &devPath, const QList<QDeviceUEvent> &members);
+    //Linux: a known device was mounted at or unmounted from mountPoint, see setMountTrackingEnabled()
+    void deviceMounted(const QString &dev, const QString &mountPoint);
+    void deviceUnmounted(const QString &dev, const QString &mountPoint);
 
 protected:
     bool running;
@@ -68,18 +349,45 @@ public:
     //static const Type EventType; //VC link error
 
     explicit QDeviceChangeEvent(Action action, const QString &device);
+    explicit QDeviceChangeEvent(const QDeviceUEvent &uevent);
 
     Action action() const { return m_action; }
     QString device() const { return m_device; }
+    QDeviceUEvent uevent() const { return m_uevent; }
     static Type registeredType()
     {
         static Type EventType = static_cast<Type>(registerEventType());
         return EventType;
     }
 
+    //events are recycled through a pool instead of the heap
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr, size_t size);
+
 private:
     Action m_action;
     QString m_device;
+    QDeviceUEvent m_uevent;
 };
 
+class Q_DW_EXPORT QDeviceChangeBatchEvent : public QEvent
+{
+public:
+    explicit QDeviceChangeBatchEvent(const QList<QDeviceUEvent> &uevents);
+
+    QList<QDeviceUEvent> uevents() const { return m_uevents; }
+    static Type registeredType()
+    {
+        static Type EventType = static_cast<Type>(registerEventType());
+        return EventType;
+    }
+
+private:
+    QList<QDeviceUEvent> m_uevents;
+};
+
+Q_DECLARE_OPERATORS_FOR_FLAGS(QDeviceWatcher::DeliveryFlags)
+Q_DECLARE_METATYPE(QDeviceUEvent)
+Q_DECLARE_METATYPE(QList<QDeviceUEvent>)
+
 #endif // QDEVICEWATCHER_H
@@ -26,6 +26,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <stddef.h>
+
 #include <linux/version.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 0)
 #else
@@ -33,19 +35,31 @@
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/filter.h>
 #include <linux/netlink.h>
+#include <linux/sock_diag.h>
 #include <linux/types.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/un.h>
 #include <unistd.h>
 
 #include <QtCore/QCoreApplication>
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-#include <QtCore/qregexp.h>
-#else
-#include <QRegExp>
-#endif
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QSet>
+#include <QtCore/QTimer>
+#include <QtCore/QVector>
+#include <QtCore/QtEndian>
 #if CONFIG_SOCKETNOTIFIER
 #include <QtCore/QSocketNotifier>
 #elif CONFIG_TCPSOCKET
@@ -53,100 +67,1401 @@
 #endif
 
 #define UEVENT_BUFFER_SIZE 2048
+#define UEVENT_MESSAGE_SIZE 8192 //libudev monitor messages, header and properties
+#define UEVENT_BATCH_SIZE 32 //datagrams per recvmmsg() call
+#define UEVENT_CONTROL_SIZE (CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(struct ucred)))
+#define UEVENT_TRUESIZE 4096 //about the kernel memory of a queued uevent
+#define RCVBUF_SHRINK_CYCLES 64
 
 enum udev_monitor_netlink_group { UDEV_MONITOR_NONE, UDEV_MONITOR_KERNEL, UDEV_MONITOR_UDEV };
 
 QDeviceWatcherPrivate::~QDeviceWatcherPrivate()
 {
     stop();
-    close(netlink_socket);
-    netlink_socket = -1;
+    delete reader;
+    delete[] recv_addr;
+    delete[] recv_msgs;
+    delete[] recv_iov;
+    delete[] recv_control;
+    delete source;
 }
 
 bool QDeviceWatcherPrivate::start()
 {
     if (!init())
         return false;
+    if (!record_file.isEmpty() && !recorder.open(record_file))
+        qWarning("can not record uevents to %s: %s", record_file.constData(), strerror(errno));
+    registry.clear(); //events were missed while stopped
+    names.clear();
+    attributes.clear();
+    registry_changed = true;
+    last_seqnum = 0;
+    events_lost.storeRelaxed(0);
+    if (netlink_socket == -1) //no SEQNUM gap can be told from sysfs for other sources
+        track_seqnum = false;
+    //the socket is bound now, so events during the scan are queued and none is lost
+    if (coldplug) {
+        foreach (const QByteArray &uevent, scanDevices())
+            parseUEvent(uevent.constData(), uevent.size());
+    }
+    endBatch();
+    //coldplug is not held, its devices are distinct anyway
+    coalescer.setWindow(coalesce_window);
+    if (coalesce_window > 0 && !coalesce_timer) {
+        coalesce_timer = new QTimer(this);
+        connect(coalesce_timer, SIGNAL(timeout()), SLOT(coalesceTick()));
+    }
+    transactions.setSettleInterval(settle_interval);
+    if (settle_interval > 0 && !settle_timer) {
+        settle_timer = new QTimer(this);
+        settle_timer->setSingleShot(true);
+        connect(settle_timer, SIGNAL(timeout()), SLOT(settleTransactions()));
+    }
+    settle_clock.start();
+    if (mount_tracking && mountinfo_fd == -1) {
+        mountinfo_fd = ::open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+        if (mountinfo_fd == -1) {
+            qWarning("can not track mounts: %s", strerror(errno));
+        } else {
+            readMountTable(false);
+            mount_notifier = new QSocketNotifier(mountinfo_fd, QSocketNotifier::Exception, this);
+            connect(mount_notifier, SIGNAL(activated(int)), SLOT(mountTableChanged()));
+        }
+    }
+    if (threaded) {
+        if (!reader)
+            reader = new QDeviceReaderThread(this);
+        if (!reader->start(source_fd)) {
+            source->close(this);
+            source_fd = -1;
+            return false;
+        }
+        drain_notifier = new QSocketNotifier(reader->wakeDescriptor(), QSocketNotifier::Read, this);
+        connect(drain_notifier, SIGNAL(activated(int)), SLOT(drainReader()));
+        return true;
+    }
 #if CONFIG_SOCKETNOTIFIER
     socket_notifier->setEnabled(true);
 #elif CONFIG_TCPSOCKET
     connect(tcp_socket, SIGNAL(readyRead()), SLOT(parseDeviceInfo()));
-#else
-    this->QThread::start();
 #endif
     return true;
 }
 
 bool QDeviceWatcherPrivate::stop()
 {
-    if (netlink_socket != -1) {
+    if (source_fd != -1) {
+        if (drain_notifier) { //before its eventfd is closed
+            drain_notifier->setEnabled(false);
+            drain_notifier->deleteLater();
+            drain_notifier = 0;
+        }
+        if (reader) //joined before the socket is closed
+            reader->stop();
 #if CONFIG_SOCKETNOTIFIER
-        socket_notifier->setEnabled(false);
+        if (socket_notifier) { //may be stopped in a slot called from its activation
+            socket_notifier->setEnabled(false);
+            socket_notifier->deleteLater();
+            socket_notifier = 0;
+        }
 #elif CONFIG_TCPSOCKET
         //tcp_socket->close(); //how to restart?
         disconnect(this, SLOT(parseDeviceInfo()));
-#else
-        this->quit();
 #endif
-        close(netlink_socket);
-        netlink_socket = -1;
+        source->close(this);
+        source_fd = -1;
+        rcvbuf_size.storeRelaxed(0);
+        recorder.close();
+        //nothing is reported after stop(), and the coldplug of the next start() is not held
+        coalescer.setWindow(0);
+        if (coalesce_timer)
+            coalesce_timer->stop();
+        transactions.setSettleInterval(0); //as the coalescer, coldplug is not grouped
+        if (settle_timer)
+            settle_timer->stop();
+        attributes.clear(); //no events invalidate them any more
+    }
+    if (mount_notifier) { //may be stopped in a slot called from its activation
+        mount_notifier->setEnabled(false);
+        mount_notifier->deleteLater();
+        mount_notifier = 0;
+    }
+    if (mountinfo_fd != -1) {
+        ::close(mountinfo_fd);
+        mountinfo_fd = -1;
+        mount_table.clear();
+    }
+    return true;
+}
+
+bool QDeviceWatcherPrivate::setSource(QDeviceUEventSource *s)
+{
+    if (source_fd != -1) {
+        qWarning("can not change the uevent source while running");
+        delete s;
+        return false;
     }
+    delete source;
+    source = s;
     return true;
 }
 
+//SO_TIMESTAMPNS of a received datagram, ns since the epoch. 0 if missing
+static qint64 receiveTime(struct msghdr *msg)
+{
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+            return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+        }
+    }
+    return 0;
+}
+
+//SO_PASSCRED of a received datagram. As libudev, only root may send uevents
+static bool senderIsRoot(struct msghdr *msg)
+{
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_CREDENTIALS) {
+            struct ucred cred;
+            memcpy(&cred, CMSG_DATA(c), sizeof(cred));
+            return cred.uid == 0;
+        }
+    }
+    return false;
+}
+
+/*!
+  Receive every pending datagram with recvmmsg() and parse them in order.
+  A burst of uevents costs one notifier activation instead of one per uevent.
+  The queue occupancy found on entry and the size of the burst drive the receive buffer size.
+  Returns the number of datagrams received, or -1 on error.
+*/
+int QDeviceWatcherPrivate::receiveBatch(int fd)
+{
+    quint32 drops = rcvbuf_drops;
+    const int queued = queuedBytes(fd, &drops);
+    bool overflow = false;
+    int total = 0;
+    quint64 bytes = 0;
+    for (;;) {
+        for (int i = 0; i < UEVENT_BATCH_SIZE; ++i) //the kernel sets the length it used
+            recv_msgs[i].msg_hdr.msg_controllen = UEVENT_CONTROL_SIZE;
+        const int n = recvmmsg(fd, recv_msgs, UEVENT_BATCH_SIZE, MSG_DONTWAIT, NULL);
+        zDebug("read fro socket %d datagrams", n);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == ENOBUFS) { //reported once, the socket goes on with the next datagram
+            qWarning("uevent receive queue overflow, resynchronising");
+            counters.overflows.fetchAndAddRelaxed(1);
+            overflow = true;
+            events_lost.storeRelease(1);
+            continue;
+        }
+        if (n <= 0) {
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                qWarning("recvmmsg failed: %s", strerror(errno));
+                if (total == 0)
+                    total = -1;
+            }
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            bytes += recv_msgs[i].msg_len;
+            //kernel messages come from pid 0, udev messages from udevd running as root. Drop anything else
+            if (fd == netlink_socket && (recv_addr[i].nl_pid == 0) != (netlink_group == QDeviceWatcher::KernelGroup)) {
+                zDebug("ignore message from pid %u", recv_addr[i].nl_pid);
+                continue;
+            }
+            if (fd == netlink_socket && !senderIsRoot(&recv_msgs[i].msg_hdr)) {
+                zDebug("ignore message from non-root sender, pid %u", recv_addr[i].nl_pid);
+                continue;
+            }
+            if (recv_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                qWarning("uevent message truncated, resynchronising");
+                counters.missed.fetchAndAddRelaxed(1);
+                events_lost.storeRelease(1);
+                continue;
+            }
+            receiveUEvent((const char *) recv_iov[i].iov_base, recv_msgs[i].msg_len, receiveTime(&recv_msgs[i].msg_hdr));
+        }
+        total += n;
+        if (n < UEVENT_BATCH_SIZE) //drained
+            break;
+    }
+    if (total > 0) {
+        counters.datagrams.fetchAndAddRelaxed(total);
+        counters.bytes.fetchAndAddRelaxed(bytes);
+    }
+    //the queue may be almost empty when we wake up in the middle of a burst
+    const int occupancy = qMax(queued, total * UEVENT_TRUESIZE);
+    if (occupancy > counters.rcvbuf_high_water.loadRelaxed())
+        counters.rcvbuf_high_water.storeRelaxed(occupancy);
+    if (fd == netlink_socket) {
+        adaptReceiveBuffer(occupancy, overflow || drops != rcvbuf_drops);
+        rcvbuf_drops = drops;
+    }
+    return total;
+}
+
+/*!
+  Request a receive buffer of size bytes. SO_RCVBUFFORCE needs CAP_NET_ADMIN, if it is
+  denied once SO_RCVBUF is used, which the kernel limits to net.core.rmem_max.
+*/
+bool QDeviceWatcherPrivate::setReceiveBuffer(int size)
+{
+    if (rcvbuf_force && setsockopt(netlink_socket, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0) {
+        if (errno != EPERM)
+            qWarning("SO_RCVBUFFORCE failed: %s", strerror(errno));
+        rcvbuf_force = false;
+    }
+    if (!rcvbuf_force && setsockopt(netlink_socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+        qWarning("SO_RCVBUF failed: %s", strerror(errno));
+        return false;
+    }
+    rcvbuf = size;
+    int granted = 0; //twice the request, the kernel reserves half for its bookkeeping
+    socklen_t len = sizeof(granted);
+    if (getsockopt(netlink_socket, SOL_SOCKET, SO_RCVBUF, &granted, &len) == 0)
+        rcvbuf_size.storeRelaxed(granted);
+    zDebug("receive buffer %d bytes requested, %d granted", size, granted);
+    return true;
+}
+
+//kernel memory of the queued datagrams, -1 if unknown. drops is the socket's drop counter
+int QDeviceWatcherPrivate::queuedBytes(int fd, quint32 *drops) const
+{
+#ifdef SO_MEMINFO
+    quint32 meminfo[SK_MEMINFO_VARS];
+    socklen_t len = sizeof(meminfo);
+    if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0 && len > SK_MEMINFO_DROPS * sizeof(quint32)) {
+        *drops = meminfo[SK_MEMINFO_DROPS];
+        return meminfo[SK_MEMINFO_RMEM_ALLOC];
+    }
+#else
+    Q_UNUSED(fd);
+    Q_UNUSED(drops);
+#endif //SO_MEMINFO
+    return -1;
+}
+
+/*!
+  Double the buffer (up to rcvbuf_max) if a receive cycle found it more than half full or
+  events were dropped. Halve it (down to rcvbuf_min) after RCVBUF_SHRINK_CYCLES cycles in a
+  row using less than an eighth.
+*/
+void QDeviceWatcherPrivate::adaptReceiveBuffer(int queued, bool overflow)
+{
+    const int limit = rcvbuf_size.loadRelaxed();
+    if (overflow || queued > limit / 2) {
+        rcvbuf_quiet = 0;
+        if (rcvbuf < rcvbuf_max)
+            setReceiveBuffer(rcvbuf > rcvbuf_max / 2 ? rcvbuf_max : rcvbuf * 2);
+    } else if (queued < limit / 8 && rcvbuf > rcvbuf_min) {
+        if (++rcvbuf_quiet >= RCVBUF_SHRINK_CYCLES) {
+            rcvbuf_quiet = 0;
+            setReceiveBuffer(qMax(rcvbuf_min, rcvbuf / 2));
+        }
+    } else {
+        rcvbuf_quiet = 0;
+    }
+}
+
 void QDeviceWatcherPrivate::parseDeviceInfo()
 { //zDebug("%s active", qPrintable(QTime::currentTime().toString()));
-    QByteArray data;
 #if CONFIG_SOCKETNOTIFIER
-    //socket_notifier->setEnabled(false); //for win
-    data.resize(UEVENT_BUFFER_SIZE * 2);
-    data.fill(0);
-    size_t len = read(socket_notifier->socket(), data.data(), UEVENT_BUFFER_SIZE * 2);
-    zDebug("read fro socket %d bytes", len);
-    data.resize(len);
-    //socket_notifier->setEnabled(true); //for win
+    if (source->receive(this) < 0 && socket_notifier) { //end of the stream or error
+        zDebug("uevent source closed");
+        socket_notifier->setEnabled(false);
+    }
+    recorder.flush();
+    endBatch();
 #elif CONFIG_TCPSOCKET
-    data = tcp_socket->readAll();
+    const qint64 len = tcp_socket->read(buffer.data(), UEVENT_MESSAGE_SIZE);
+    zDebug("read fro socket %d bytes", (int) len);
+    if (len > 0)
+        parseUEvent(buffer.constData(), len);
+    endBatch();
 #endif
-    data = data.replace(0, '\n').trimmed(); //In the original line each information is seperated by 0
-    if (buffer.isOpen())
-        buffer.close();
-    buffer.setBuffer(&data);
-    buffer.open(QIODevice::ReadOnly);
-    while (!buffer.atEnd()) { //buffer.canReadLine() always false?
-        parseLine(buffer.readLine().trimmed());
-    }
-    buffer.close();
-}
-
-#if CONFIG_THREAD
-//another thread
-void QDeviceWatcherPrivate::run()
-{
-    QByteArray data;
-    //loop only when event happens. because of recv() block the function?
-    while (1) {
-        //char buf[UEVENT_BUFFER_SIZE*2] = {0};
-        //recv(d->netlink_socket, &buf, sizeof(buf), 0);
-        data.resize(UEVENT_BUFFER_SIZE * 2);
-        data.fill(0);
-        size_t len = recv(netlink_socket, data.data(), data.size(), 0);
-        zDebug("read fro socket %d bytes", len);
-        data.resize(len);
-        data = data.replace(0, '\n').trimmed();
-        if (buffer.isOpen())
-            buffer.close();
-        buffer.setBuffer(&data);
-        buffer.open(QIODevice::ReadOnly);
-        QByteArray line = buffer.readLine();
-        while (!line.isNull()) {
-            parseLine(line.trimmed());
-            line = buffer.readLine();
-        }
-        buffer.close();
-    }
-}
-#endif //CONFIG_THREAD
+}
+
+struct linux_dirent64
+{
+    quint64 d_ino;
+    qint64 d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+//names in directory fd, without "." and "..". getdents64 reads many entries per syscall
+static QList<QByteArray> listDir(int fd)
+{
+    QList<QByteArray> names;
+    char buf[8192];
+    for (;;) {
+        const long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+        if (n <= 0)
+            break;
+        for (long pos = 0; pos < n;) {
+            const struct linux_dirent64 *d = (const struct linux_dirent64 *) (buf + pos);
+            pos += d->d_reclen;
+            if (d->d_name[0] == '.' && (d->d_name[1] == 0 || (d->d_name[1] == '.' && d->d_name[2] == 0)))
+                continue;
+            names.append(QByteArray(d->d_name));
+        }
+    }
+    return names;
+}
+
+static QList<QByteArray> listDir(const QByteArray &path)
+{
+    const int fd = open(path.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return QList<QByteArray>();
+    const QList<QByteArray> names = listDir(fd);
+    close(fd);
+    return names;
+}
+
+/*!
+  Build a kernel style "add@devpath\0ACTION=add\0..." datagram for every device of a subsystem
+  directory not in seen yet. /sys/class/<subsystem>/<name> and /sys/bus/<subsystem>/devices/<name>
+  link to ../../devices/..., the properties are read from its uevent file with openat(), so no
+  path is resolved from the root.
+*/
+static void scanSubsystem(int dirfd, const QByteArray &subsystem, QSet<QByteArray> *seen, QList<QByteArray> *uevents)
+{
+    foreach (const QByteArray &name, listDir(dirfd)) {
+        char target[PATH_MAX];
+        const ssize_t len = readlinkat(dirfd, name.constData(), target, sizeof(target));
+        if (len <= 0 || len == sizeof(target))
+            continue;
+        int i = 0; //strip "../"
+        while (i + 3 <= len && memcmp(target + i, "../", 3) == 0)
+            i += 3;
+        const QByteArray devpath = "/" + QByteArray(target + i, len - i);
+        if (seen->contains(devpath))
+            continue;
+        seen->insert(devpath);
+
+        char props[4096];
+        const int fd = openat(dirfd, (name + "/uevent").constData(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        const ssize_t size = read(fd, props, sizeof(props));
+        close(fd);
+        if (size < 0)
+            continue;
+
+        QByteArray uevent;
+        uevent.reserve(devpath.size() * 2 + subsystem.size() + size + 48);
+        uevent.append("add@").append(devpath).append('\0');
+        uevent.append("ACTION=add").append('\0');
+        uevent.append("DEVPATH=").append(devpath).append('\0');
+        uevent.append("SUBSYSTEM=").append(subsystem).append('\0');
+        uevent.append(props, size);
+        for (int j = uevent.size() - size; j < uevent.size(); ++j) {
+            if (uevent.at(j) == '\n')
+                uevent.data()[j] = 0;
+        }
+        uevents->append(uevent);
+    }
+}
+
+/*!
+  Synthetic "add" uevents for the devices already present. Bus devices (usb, pci, scsi...) live
+  in /sys/bus/<subsystem>/devices, class devices in /sys/class/<subsystem>. Buses come first,
+  they hold most of the parents.
+*/
+QList<QByteArray> QDeviceWatcherPrivate::scanDevices() const
+{
+    QList<QByteArray> uevents;
+    QSet<QByteArray> seen; //devpaths, a subsystem may be a bus and a class
+    QList<QByteArray> buses = subsystem_filter;
+    QList<QByteArray> classes = subsystem_filter;
+    if (subsystem_filter.isEmpty()) {
+        buses = listDir(QByteArray("/sys/bus"));
+        classes = listDir(QByteArray("/sys/class"));
+    }
+    foreach (const QByteArray &subsystem, buses) {
+        const int fd = open(("/sys/bus/" + subsystem + "/devices").constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        scanSubsystem(fd, subsystem, &seen, &uevents);
+        close(fd);
+    }
+    foreach (const QByteArray &subsystem, classes) {
+        const int fd = open(("/sys/class/" + subsystem).constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        scanSubsystem(fd, subsystem, &seen, &uevents);
+        close(fd);
+    }
+    zDebug("%d devices", uevents.size());
+    return uevents;
+}
+
+QDeviceCoalescer::QDeviceCoalescer()
+    : now(0)
+    , window_ms(0)
+    , tick_ms(1)
+    , window_ticks(0)
+{}
+
+void QDeviceCoalescer::setWindow(int msecs)
+{
+    clear();
+    window_ms = qMax(msecs, 0);
+    //16 to 31 ticks per window, the deadline is one more, so always less than Slots
+    tick_ms = qMax(1, window_ms / 16);
+    window_ticks = (window_ms + tick_ms - 1) / tick_ms;
+}
+
+void QDeviceCoalescer::clear()
+{
+    held.clear();
+    for (int i = 0; i < Slots; ++i)
+        wheel[i].clear();
+}
+
+int QDeviceCoalescer::add(const QDeviceUEvent &uevent, QList<QDeviceUEvent> *ready)
+{
+    const QDeviceUEventPrivate *d = uevent.d.constData();
+    const QDeviceUEvent::Action action = d->action;
+    if (!d->devpath.isNull()) {
+        QHash<QByteArray, Held>::iterator it = held.find(d->field(d->devpath));
+        if (it != held.end()) {
+            const QDeviceUEvent::Action first = it.value().uevent.d->action;
+            if (first == QDeviceUEvent::Add && action == QDeviceUEvent::Change) {
+                //still an add, with the properties of the change
+                const QByteArray datagram = QDeviceWatcherPrivate::synthesizeUEvent(uevent, "add");
+                QDeviceUEvent merged = QDeviceUEvent::fromRawData(datagram.constData(), datagram.size());
+                merged.d->node = d->node;
+                merged.d->seqnum = d->seqnum;
+                merged.d->timestamp = d->timestamp;
+                it.value().uevent = merged; //keeps the deadline of the add
+                return 1;
+            }
+            if (first == QDeviceUEvent::Add && action == QDeviceUEvent::Remove) {
+                held.erase(it); //its key in the wheel is skipped by tick()
+                return 2;
+            }
+            if (first == QDeviceUEvent::Change && (action == QDeviceUEvent::Change || action == QDeviceUEvent::Remove)) {
+                it.value().uevent = uevent; //keeps the deadline of the first one
+                return 1;
+            }
+            //e.g. remove and add is a new device: report both, in order
+            ready->append(it.value().uevent);
+            held.erase(it);
+        }
+    }
+    if (d->devpath.isNull() || (action != QDeviceUEvent::Add && action != QDeviceUEvent::Change && action != QDeviceUEvent::Remove)) {
+        ready->append(uevent);
+        return 0;
+    }
+    //one tick more, the current tick is partly over
+    Held h;
+    h.uevent = uevent;
+    h.deadline = now + window_ticks + 1;
+    const QByteArray key(d->raw.constData() + d->devpath.offset, d->devpath.size);
+    held.insert(key, h);
+    wheel[h.deadline % Slots].append(key);
+    return 0;
+}
+
+void QDeviceCoalescer::tick(QList<QDeviceUEvent> *ready)
+{
+    ++now;
+    QVector<QByteArray> &keys = wheel[now % Slots];
+    foreach (const QByteArray &key, keys) {
+        QHash<QByteArray, Held>::iterator it = held.find(key);
+        //merged away, or held again later
+        if (it == held.end() || it.value().deadline != now)
+            continue;
+        ready->append(it.value().uevent);
+        held.erase(it);
+    }
+    keys.clear();
+}
+
+void QDeviceWatcherPrivate::deliverCoalesced()
+{
+    if (coalesce_ready.isEmpty())
+        return;
+    //a slot may stop the watcher, or process events and receive more
+    QList<QDeviceUEvent> ready;
+    ready.swap(coalesce_ready);
+    foreach (const QDeviceUEvent &uevent, ready) {
+        if (source_fd == -1)
+            break;
+        deliverUEvent(uevent);
+    }
+}
+
+void QDeviceWatcherPrivate::coalesceTick()
+{
+    coalescer.tick(&coalesce_ready);
+    if (coalescer.isEmpty())
+        coalesce_timer->stop();
+    if (coalesce_ready.isEmpty())
+        return;
+    deliverCoalesced();
+    endBatch();
+}
+
+void QDeviceTransactions::setSettleInterval(int msecs)
+{
+    clear();
+    settle = qMax(msecs, 0);
+}
+
+void QDeviceTransactions::merge(Transaction *into, const Transaction &from)
+{
+    QList<QDeviceUEvent> members;
+    QVector<quint64> arrivals;
+    members.reserve(into->members.size() + from.members.size());
+    arrivals.reserve(members.size());
+    int i = 0, j = 0;
+    while (i < into->members.size() || j < from.members.size()) {
+        if (j == from.members.size() || (i < into->members.size() && into->arrivals.at(i) < from.arrivals.at(j))) {
+            members.append(into->members.at(i));
+            arrivals.append(into->arrivals.at(i++));
+        } else {
+            members.append(from.members.at(j));
+            arrivals.append(from.arrivals.at(j++));
+        }
+    }
+    into->members.swap(members);
+    into->arrivals.swap(arrivals);
+}
+
+bool QDeviceTransactions::cancel(const char *root, int size)
+{
+    bool cancelled = false;
+    for (int i = 0; i < open.size(); ++i) {
+        if (open.at(i).action == QDeviceUEvent::Add && open.at(i).root == QByteArray::fromRawData(root, size)) {
+            open.removeAt(i);
+            cancelled = true;
+            break; //transactions are disjoint
+        }
+    }
+    if (!cancelled)
+        return false;
+    //its children went first, their departure is no news either
+    for (int i = 0; i < open.size(); ++i) {
+        const Transaction &t = open.at(i);
+        if (t.action == QDeviceUEvent::Remove && isDevPathAncestor(root, size, t.root.constData(), t.root.size()))
+            open.removeAt(i--);
+    }
+    return true;
+}
+
+void QDeviceTransactions::add(const QDeviceUEvent &uevent, qint64 now)
+{
+    const QDeviceUEventPrivate *d = uevent.d.constData();
+    if (d->devpath.isNull())
+        return;
+    const char *path = d->raw.constData() + d->devpath.offset;
+    const int size = d->devpath.size;
+    ++arrivals;
+    //came and went within the settle interval
+    if (d->action == QDeviceUEvent::Remove && cancel(path, size))
+        return;
+    const bool opens = d->action == QDeviceUEvent::Add || d->action == QDeviceUEvent::Remove;
+    int joined = -1;
+    for (int i = 0; i < open.size(); ++i) {
+        Transaction &t = open[i];
+        if (opens && t.action != d->action)
+            continue;
+        if (isDevPathAncestor(t.root.constData(), t.root.size(), path, size)) {
+            joined = i;
+            break; //transactions are disjoint, no other one contains path
+        }
+        if (!opens || !isDevPathAncestor(path, size, t.root.constData(), t.root.size()))
+            continue;
+        if (joined < 0) {
+            joined = i;
+            t.root = QByteArray(path, size);
+        } else { //path is a common ancestor: one transaction
+            merge(&open[joined], t);
+            open.removeAt(i--);
+        }
+    }
+    if (joined < 0) {
+        if (!opens) //e.g. a change of a device that is not coming or going
+            return;
+        Transaction t;
+        t.root = QByteArray(path, size);
+        t.action = d->action;
+        open.append(t);
+        joined = open.size() - 1;
+    }
+    Transaction &t = open[joined];
+    t.members.append(uevent);
+    t.arrivals.append(arrivals);
+    t.deadline = now + settle;
+}
+
+QList<QDeviceTransactions::Transaction> QDeviceTransactions::takeSettled(qint64 now)
+{
+    QList<Transaction> settled;
+    for (int i = 0; i < open.size(); ++i) {
+        if (open.at(i).deadline > now)
+            continue;
+        settled.append(open.at(i));
+        open.removeAt(i--);
+    }
+    return settled;
+}
+
+qint64 QDeviceTransactions::nextDeadline() const
+{
+    qint64 deadline = -1;
+    foreach (const Transaction &t, open) {
+        if (deadline < 0 || t.deadline < deadline)
+            deadline = t.deadline;
+    }
+    return deadline;
+}
+
+void QDeviceWatcherPrivate::groupUEvent(const QDeviceUEvent &uevent)
+{
+    transactions.add(uevent, settle_clock.elapsed());
+    //the deadlines only move forward, settleTransactions() rearms it for the earliest
+    if (!transactions.isEmpty() && !settle_timer->isActive())
+        settle_timer->start(transactions.settleInterval());
+}
+
+void QDeviceWatcherPrivate::settleTransactions()
+{
+    const qint64 now = settle_clock.elapsed();
+    const QList<QDeviceTransactions::Transaction> settled = transactions.takeSettled(now);
+    if (!transactions.isEmpty())
+        settle_timer->start(int(qMax<qint64>(transactions.nextDeadline() - now, 1)));
+    foreach (const QDeviceTransactions::Transaction &t, settled) {
+        if (source_fd == -1) //a slot stopped the watcher
+            break;
+        zDebug("%s %s: %d events", t.action == QDeviceUEvent::Add ? "arrived" : "departed", t.root.constData(), t.members.size());
+        if (t.action == QDeviceUEvent::Add)
+            emit watcher->deviceArrived(QString::fromLocal8Bit(t.root), t.members);
+        else
+            emit watcher->deviceDeparted(QString::fromLocal8Bit(t.root), t.members);
+    }
+}
+
+//mountinfo escapes space, tab, newline and backslash as \ooo
+static QByteArray unescapeMountPoint(const char *s, int size)
+{
+    QByteArray path;
+    path.reserve(size);
+    for (int i = 0; i < size; ++i) {
+        if (s[i] == '\\' && i + 3 < size && s[i + 1] >= '0' && s[i + 1] <= '3'
+            && s[i + 2] >= '0' && s[i + 2] <= '7' && s[i + 3] >= '0' && s[i + 3] <= '7') {
+            path.append(char((s[i + 1] - '0') * 64 + (s[i + 2] - '0') * 8 + (s[i + 3] - '0')));
+            i += 3;
+        } else {
+            path.append(s[i]);
+        }
+    }
+    return path;
+}
+
+//"36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw". The optional fields end at "-"
+bool QDeviceMountTable::parse(const char *line, const char *end, Mount *mount)
+{
+    const char *fields[5];
+    int sizes[5];
+    const char *p = line;
+    for (int i = 0; i < 5; ++i) {
+        while (p < end && *p == ' ')
+            ++p;
+        fields[i] = p;
+        while (p < end && *p != ' ')
+            ++p;
+        sizes[i] = p - fields[i];
+        if (sizes[i] == 0)
+            return false;
+    }
+    const char *colon = static_cast<const char *>(memchr(fields[2], ':', sizes[2]));
+    if (!colon)
+        return false;
+    const unsigned dev_major = strtoul(fields[2], 0, 10);
+    const unsigned dev_minor = strtoul(colon + 1, 0, 10);
+    mount->id = strtol(fields[0], 0, 10);
+    mount->devnum = dev_major ? makedev(dev_major, dev_minor) : 0;
+    mount->mount_point = unescapeMountPoint(fields[4], sizes[4]);
+    if (mount->devnum)
+        return true;
+    //anonymous: proc, tmpfs, overlay... but btrfs reports 0:N for its block devices. The source
+    //after the file system type tells them apart
+    const char *dash = p;
+    while (dash + 2 < end && !(dash[0] == ' ' && dash[1] == '-' && dash[2] == ' '))
+        ++dash;
+    if (dash + 2 >= end)
+        return true;
+    const char *source = dash + 3;
+    while (source < end && *source != ' ') //the file system type
+        ++source;
+    ++source;
+    const char *source_end = source;
+    while (source_end < end && *source_end != ' ')
+        ++source_end;
+    struct stat st;
+    if (source < end && *source == '/'
+        && stat(unescapeMountPoint(source, source_end - source).constData(), &st) == 0 && S_ISBLK(st.st_mode))
+        mount->devnum = st.st_rdev;
+    return true;
+}
+
+//entries of a changed device or mount point are unmounted and mounted again
+static bool sameMount(const QDeviceMountTable::Mount &a, const QDeviceMountTable::Mount &b)
+{
+    return a.devnum == b.devnum && a.mount_point == b.mount_point;
+}
+
+void QDeviceMountTable::update(const char *data, int size, QList<Mount> *mounted, QList<Mount> *unmounted)
+{
+    QHash<int, Mount> current;
+    current.reserve(mounts.size());
+    const char *end = data + size;
+    for (const char *line = data; line < end;) {
+        const char *eol = static_cast<const char *>(memchr(line, '\n', end - line));
+        if (!eol)
+            eol = end;
+        const int id = strtol(line, 0, 10);
+        const quint32 hash = QDeviceUEventPrivate::hash32(line, eol - line);
+        QHash<int, Mount>::const_iterator it = mounts.constFind(id);
+        Mount mount;
+        if (it != mounts.constEnd() && it.value().line_hash == hash) {
+            current.insert(id, it.value()); //unchanged, anonymous ones too
+        } else if (parse(line, eol, &mount)) {
+            mount.line_hash = hash;
+            current.insert(id, mount);
+        }
+        line = eol + 1;
+    }
+    //a remount changes the options only, a move the mount point
+    foreach (const Mount &mount, mounts) {
+        if (!mount.devnum)
+            continue;
+        QHash<int, Mount>::const_iterator it = current.constFind(mount.id);
+        if (it == current.constEnd() || !sameMount(it.value(), mount))
+            unmounted->append(mount);
+    }
+    foreach (const Mount &mount, current) {
+        if (!mount.devnum)
+            continue;
+        QHash<int, Mount>::const_iterator it = mounts.constFind(mount.id);
+        if (it == mounts.constEnd() || !sameMount(it.value(), mount))
+            mounted->append(mount);
+    }
+    QMutexLocker lock(&mutex);
+    mounts.swap(current);
+    foreach (const Mount &mount, *unmounted)
+        by_devnum.remove(mount.devnum, mount.id);
+    foreach (const Mount &mount, *mounted)
+        by_devnum.insert(mount.devnum, mount.id);
+}
+
+QList<QByteArray> QDeviceMountTable::mountPoints(quint64 devnum) const
+{
+    QMutexLocker lock(&mutex);
+    QList<QByteArray> mount_points;
+    foreach (int id, by_devnum.values(devnum))
+        mount_points.append(mounts.value(id).mount_point);
+    return mount_points;
+}
+
+void QDeviceMountTable::clear()
+{
+    QMutexLocker lock(&mutex);
+    mounts.clear();
+    by_devnum.clear();
+}
+
+void QDeviceWatcherPrivate::readMountTable(bool report)
+{
+    //the whole table from the start, the kernel generates it on read
+    if (lseek(mountinfo_fd, 0, SEEK_SET) == -1) {
+        qWarning("lseek mountinfo: %s", strerror(errno));
+        return;
+    }
+    int size = 0;
+    for (;;) {
+        if (mountinfo.size() - size < 4096)
+            mountinfo.resize(qMax(mountinfo.size() * 2, 16384));
+        const ssize_t n = read(mountinfo_fd, mountinfo.data() + size, mountinfo.size() - size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            qWarning("read mountinfo: %s", strerror(errno));
+            return;
+        }
+        if (n == 0)
+            break;
+        size += n;
+    }
+    QList<QDeviceMountTable::Mount> mounted, unmounted;
+    mount_table.update(mountinfo.constData(), size, &mounted, &unmounted);
+    if (!report)
+        return;
+    //for known devices only. A slot may stop the watcher
+    foreach (const QDeviceMountTable::Mount &mount, unmounted) {
+        const int i = registry.indexOf(mount.devnum);
+        if (i >= 0 && mountinfo_fd != -1)
+            emit watcher->deviceUnmounted(registry.devices().at(i).devNode(), QString::fromLocal8Bit(mount.mount_point));
+    }
+    foreach (const QDeviceMountTable::Mount &mount, mounted) {
+        const int i = registry.indexOf(mount.devnum);
+        if (i >= 0 && mountinfo_fd != -1)
+            emit watcher->deviceMounted(registry.devices().at(i).devNode(), QString::fromLocal8Bit(mount.mount_point));
+    }
+}
+
+void QDeviceWatcherPrivate::mountTableChanged()
+{
+    readMountTable(true);
+}
+
+static QByteArray readAttribute(int dirfd, const char *name)
+{
+    const int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return QByteArray();
+    char buf[4096]; //sysfs attributes are at most a page
+    ssize_t n;
+    do {
+        n = read(fd, buf, sizeof(buf));
+    } while (n == -1 && errno == EINTR);
+    ::close(fd);
+    if (n == -1) //e.g. write only
+        return QByteArray();
+    while (n > 0 && buf[n - 1] == '\n')
+        --n;
+    return QByteArray(buf, n);
+}
+
+QByteArray QDeviceAttributeCache::value(const QByteArray &devpath, const QByteArray &name)
+{
+    int dirfd = -1;
+    int seen;
+    {
+        QMutexLocker lock(&mutex);
+        QHash<QByteArray, Entry>::const_iterator it = entries.constFind(devpath);
+        if (it != entries.constEnd()) {
+            QHash<QByteArray, QByteArray>::const_iterator v = it.value().values.constFind(name);
+            if (v != it.value().values.constEnd())
+                return v.value();
+            //a duplicate stays valid if the entry is closed meanwhile
+            dirfd = fcntl(it.value().dirfd, F_DUPFD_CLOEXEC, 0);
+        }
+        seen = generation.loadAcquire();
+    }
+    //sysfs reads may block on a hung device, other readers must not wait for it
+    if (dirfd == -1)
+        dirfd = ::open(("/sys" + devpath).constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd == -1)
+        return QByteArray();
+    const QByteArray value = readAttribute(dirfd, name.constData());
+    QMutexLocker lock(&mutex);
+    if (generation.loadAcquire() != seen) { //an event came meanwhile, the value may be stale
+        ::close(dirfd);
+        return value;
+    }
+    QHash<QByteArray, Entry>::iterator it = entries.find(devpath);
+    if (it == entries.end()) {
+        if (entries.size() >= MaxDirs)
+            closeAll();
+        //deep copy, devpath may point into an event
+        it = entries.insert(QByteArray(devpath.constData(), devpath.size()), Entry());
+        it.value().dirfd = dirfd;
+        used.storeRelease(1);
+    } else {
+        ::close(dirfd); //the duplicate, or opened by another reader meanwhile
+    }
+    it.value().values.insert(name, value);
+    return value;
+}
+
+void QDeviceAttributeCache::invalidate(const QByteArray &devpath, bool closeDir)
+{
+    //readers outside the lock do not cache what they read meanwhile
+    generation.fetchAndAddOrdered(1);
+    if (!used.loadAcquire())
+        return;
+    QMutexLocker lock(&mutex);
+    QHash<QByteArray, Entry>::iterator it = entries.find(devpath);
+    if (it == entries.end())
+        return;
+    if (!closeDir) {
+        it.value().values.clear();
+        return;
+    }
+    ::close(it.value().dirfd);
+    entries.erase(it);
+}
+
+void QDeviceAttributeCache::clear()
+{
+    QMutexLocker lock(&mutex);
+    closeAll();
+}
+
+void QDeviceAttributeCache::closeAll()
+{
+    generation.fetchAndAddOrdered(1);
+    foreach (const Entry &e, entries)
+        ::close(e.dirfd);
+    entries.clear();
+    used.storeRelaxed(0);
+}
+
+void QDeviceNameTable::intern(QDeviceUEventPrivate *d)
+{
+    const QDeviceUEventPrivate::Field &key = d->devname.isNull() ? d->devpath : d->devname;
+    if (key.isNull() || !d->node.isEmpty())
+        return;
+    QHash<QByteArray, QString>::iterator it = names.find(d->field(key));
+    if (d->action == QDeviceUEvent::Remove) {
+        if (it == names.end()) {
+            d->node = d->nodeName();
+        } else {
+            d->node = it.value();
+            names.erase(it);
+        }
+        return;
+    }
+    if (it != names.end()) {
+        d->node = it.value();
+        return;
+    }
+    if (names.size() >= MaxSize)
+        names.clear();
+    d->node = d->nodeName();
+    //deep copy, the key must not point into the event's raw data
+    names.insert(QByteArray(d->raw.constData() + key.offset, key.size), d->node);
+}
+
+QByteArray QDeviceWatcherPrivate::synthesizeUEvent(const QDeviceUEvent &dev, const QByteArray &action)
+{
+    QByteArray uevent;
+    uevent.append(action).append('@').append(dev.d->field(dev.d->devpath)).append('\0');
+    uevent.append("ACTION=").append(action).append('\0');
+    foreach (const QByteArray &key, dev.propertyKeys()) {
+        if (key != "ACTION" && key != "SEQNUM")
+            uevent.append(key).append('=').append(dev.property(key.constData())).append('\0');
+    }
+    return uevent;
+}
+
+void QDeviceWatcherPrivate::removeDescendants(const QDeviceUEvent &uevent)
+{
+    //usually the kernel has removed them already
+    const int i = registry.indexOfDevPath(uevent.d->field(uevent.d->devpath));
+    if (i < 0)
+        return;
+    const QVector<int> descendants = registry.descendantsOf(i);
+    if (descendants.isEmpty())
+        return;
+    QList<QByteArray> removed;
+    for (int k = descendants.size() - 1; k >= 0; --k) //reversed pre-order: children first
+        removed.append(synthesizeUEvent(registry.devices().at(descendants.at(k)), "remove"));
+    zDebug("%d devices below %s", removed.size(), uevent.d->field(uevent.d->devpath).constData());
+    //the registry changes while dispatching
+    foreach (const QByteArray &remove, removed)
+        parseUEvent(remove.constData(), remove.size());
+}
+
+/*!
+  Bring the registry in line with sysfs after uevents were lost. Known devices whose sysfs
+  directory is gone are reported removed. Devices not known yet are only reported added if
+  coldplug is enabled, otherwise they can not be told apart from devices present before start().
+*/
+void QDeviceWatcherPrivate::resync()
+{
+    emitEventsLost();
+    QList<QDeviceUEvent> removed;
+    foreach (const QDeviceUEvent &dev, registry.devices()) {
+        const QByteArray devpath = dev.d->field(dev.d->devpath);
+        if (devpath.isEmpty() || access(("/sys" + devpath).constData(), F_OK) == 0 || errno != ENOENT)
+            continue;
+        removed.append(dev);
+    }
+    //the registry changes while dispatching
+    foreach (const QDeviceUEvent &dev, removed) {
+        if (registry.indexOfDevPath(dev.d->field(dev.d->devpath)) < 0) //removed with an ancestor
+            continue;
+        const QByteArray uevent = synthesizeUEvent(dev, "remove");
+        parseUEvent(uevent.constData(), uevent.size());
+    }
+    int added = 0;
+    if (coldplug) {
+        foreach (const QByteArray &uevent, scanDevices()) {
+            if (registry.indexOf(QString::fromLocal8Bit(uevent.constData() + 4)) >= 0) //"add@devpath"
+                continue;
+            parseUEvent(uevent.constData(), uevent.size());
+            ++added;
+        }
+    }
+    zDebug("%d removed, %d added", removed.size(), added);
+    Q_UNUSED(added);
+}
+
+bool QDeviceUEventRecorder::open(const QByteArray &fileName)
+{
+    close();
+    fd = ::open(fileName.constData(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size == 0)
+        buffer.append(UEVENT_LOG_MAGIC, sizeof(UEVENT_LOG_MAGIC) - 1);
+    return true;
+}
+
+void QDeviceUEventRecorder::append(const char *data, int size, qint64 timestamp)
+{
+    char header[UEVENT_LOG_RECORD_HEADER];
+    qToLittleEndian<quint32>(size, header);
+    qToLittleEndian<qint64>(timestamp, header + 4);
+    buffer.append(header, sizeof(header));
+    buffer.append(data, size);
+}
+
+void QDeviceUEventRecorder::flush()
+{
+    if (fd == -1 || buffer.isEmpty())
+        return;
+    const char *data = buffer.constData();
+    qint64 left = buffer.size();
+    while (left > 0) {
+        const ssize_t n = write(fd, data, left);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            qWarning("write uevent log failed: %s", strerror(errno));
+            break;
+        }
+        data += n;
+        left -= n;
+    }
+    buffer.clear();
+}
+
+void QDeviceUEventRecorder::close()
+{
+    if (fd == -1)
+        return;
+    flush();
+    ::close(fd);
+    fd = -1;
+}
+
+static qint64 monotonicTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+QDeviceReplaySource::QDeviceReplaySource(const QByteArray &fileName, qreal speed)
+    : file_name(fileName)
+    , speed(speed)
+    , timer_fd(-1)
+    , map(0)
+    , map_size(0)
+    , pos(0)
+    , start(0)
+    , first(0)
+{}
+
+QDeviceReplaySource::~QDeviceReplaySource()
+{
+    close(0);
+}
+
+int QDeviceReplaySource::open(QDeviceWatcherPrivate *d)
+{
+    Q_UNUSED(d);
+    const int fd = ::open(file_name.constData(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        qWarning("can not open uevent log %s: %s", file_name.constData(), strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    const int header = sizeof(UEVENT_LOG_MAGIC) - 1;
+    if (fstat(fd, &st) < 0 || st.st_size < header) {
+        qWarning("invalid uevent log %s", file_name.constData());
+        ::close(fd);
+        return -1;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); //the mapping stays
+    if (p == MAP_FAILED) {
+        qWarning("mmap uevent log failed: %s", strerror(errno));
+        return -1;
+    }
+    map = (const char *) p;
+    map_size = st.st_size;
+    madvise(p, map_size, MADV_SEQUENTIAL);
+    if (memcmp(map, UEVENT_LOG_MAGIC, header) != 0) {
+        qWarning("%s is not a uevent log", file_name.constData());
+        close(d);
+        return -1;
+    }
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1) {
+        qWarning("timerfd_create failed: %s", strerror(errno));
+        close(d);
+        return -1;
+    }
+    pos = header;
+    start = monotonicTime();
+    first = map_size - pos >= UEVENT_LOG_RECORD_HEADER ? qFromLittleEndian<qint64>(map + pos + 4) : 0;
+    arm(start);
+    return timer_fd;
+}
+
+//readable at due, CLOCK_MONOTONIC ns. A due time passed already fires at once
+void QDeviceReplaySource::arm(qint64 due)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (due <= 0)
+        due = 1; //0 disarms
+    its.it_value.tv_sec = due / 1000000000;
+    its.it_value.tv_nsec = due % 1000000000;
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        qWarning("timerfd_settime failed: %s", strerror(errno));
+}
+
+int QDeviceReplaySource::receive(QDeviceWatcherPrivate *d)
+{
+    quint64 expirations;
+    const ssize_t len = read(timer_fd, &expirations, sizeof(expirations));
+    Q_UNUSED(len);
+    const qint64 now = monotonicTime();
+    int count = 0;
+    quint64 bytes = 0;
+    while (pos < map_size && count < UEVENT_BATCH_SIZE * 8) {
+        if (map_size - pos < UEVENT_LOG_RECORD_HEADER) {
+            qWarning("truncated uevent log");
+            pos = map_size;
+            break;
+        }
+        const quint32 size = qFromLittleEndian<quint32>(map + pos);
+        const qint64 timestamp = qFromLittleEndian<qint64>(map + pos + 4);
+        if (size > quint64(map_size - pos - UEVENT_LOG_RECORD_HEADER)) {
+            qWarning("truncated uevent log");
+            pos = map_size;
+            break;
+        }
+        if (speed > 0) {
+            const qint64 due = start + qint64((timestamp - first) / speed);
+            if (due > now) {
+                arm(due);
+                break;
+            }
+        }
+        //parsed in place, only kept events are copied
+        d->receiveUEvent(map + pos + UEVENT_LOG_RECORD_HEADER, size);
+        pos += UEVENT_LOG_RECORD_HEADER + size;
+        bytes += size;
+        ++count;
+    }
+    d->counters.datagrams.fetchAndAddRelaxed(count);
+    d->counters.bytes.fetchAndAddRelaxed(bytes);
+    if (pos >= map_size)
+        return -1; //the end
+    if (speed <= 0 || count == UEVENT_BATCH_SIZE * 8)
+        arm(now); //more are due already
+    return count;
+}
+
+void QDeviceReplaySource::close(QDeviceWatcherPrivate *d)
+{
+    Q_UNUSED(d);
+    if (timer_fd != -1)
+        ::close(timer_fd);
+    timer_fd = -1;
+    if (map)
+        munmap((void *) map, map_size);
+    map = 0;
+    map_size = 0;
+}
+
+QDeviceReaderThread::QDeviceReaderThread(QDeviceWatcherPrivate *d)
+    : d(d)
+    , socket(-1)
+    , epoll_fd(-1)
+    , cancel_fd(-1)
+    , space_fd(-1)
+    , wake_fd(-1)
+{}
+
+QDeviceReaderThread::~QDeviceReaderThread()
+{
+    stop();
+}
+
+bool QDeviceReaderThread::start(int fd)
+{
+    socket = fd;
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    cancel_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    space_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (epoll_fd < 0 || cancel_fd < 0 || space_fd < 0 || wake_fd < 0) {
+        qWarning("error creating reader thread fds: %s", strerror(errno));
+        stop();
+        return false;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = socket;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket, &ev) < 0) {
+        qWarning("epoll_ctl failed: %s", strerror(errno));
+        stop();
+        return false;
+    }
+    ev.data.fd = cancel_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cancel_fd, &ev);
+    drain_pending.storeRelaxed(0);
+    waiting.storeRelaxed(0);
+    QThread::start();
+    return true;
+}
+
+void QDeviceReaderThread::stop()
+{
+    if (cancel_fd != -1) {
+        const quint64 one = 1;
+        if (write(cancel_fd, &one, sizeof(one)) < 0)
+            qWarning("cancel reader thread failed: %s", strerror(errno));
+        wait();
+    }
+    if (epoll_fd != -1)
+        close(epoll_fd);
+    if (cancel_fd != -1)
+        close(cancel_fd);
+    if (space_fd != -1)
+        close(space_fd);
+    if (wake_fd != -1)
+        close(wake_fd);
+    epoll_fd = cancel_fd = space_fd = wake_fd = socket = -1;
+    //parsed but not dispatched yet
+    while (QDeviceUEventPrivate *uevent = pop())
+        delete uevent;
+}
+
+void QDeviceReaderThread::run()
+{
+    struct epoll_event events[2];
+    for (;;) {
+        const int n = epoll_wait(epoll_fd, events, 2, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            qWarning("epoll_wait failed: %s", strerror(errno));
+            return;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.fd == cancel_fd)
+                return;
+        }
+        //parseUEvent() pushes into the ring
+        if (d->source->receive(d) < 0) //end of the stream or error, wait for stop()
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, socket, NULL);
+        d->recorder.flush();
+        requestDrain();
+    }
+}
+
+bool QDeviceReaderThread::push(QDeviceUEventPrivate *uevent)
+{
+    while (!ring.push(uevent)) {
+        waiting.storeRelease(1);
+        if (ring.push(uevent)) //drained meanwhile
+            break;
+        requestDrain();
+        struct pollfd fds[2];
+        fds[0].fd = cancel_fd;
+        fds[1].fd = space_fd;
+        fds[0].events = fds[1].events = POLLIN;
+        fds[0].revents = fds[1].revents = 0;
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            qWarning("poll failed: %s", strerror(errno));
+            delete uevent;
+            return false;
+        }
+        if (fds[0].revents) { //stopped
+            delete uevent;
+            return false;
+        }
+        quint64 value;
+        const ssize_t len = read(space_fd, &value, sizeof(value));
+        Q_UNUSED(len);
+    }
+    const int depth = ring.size();
+    if (depth > d->counters.queue_high_water.loadRelaxed())
+        d->counters.queue_high_water.storeRelaxed(depth);
+    return true;
+}
+
+void QDeviceReaderThread::requestDrain()
+{
+    //a write() instead of a queued call, which would allocate an event and look the slot up
+    if ((!ring.isEmpty() || d->events_lost.loadAcquire()) && drain_pending.testAndSetOrdered(0, 1)) {
+        const quint64 one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0)
+            qWarning("wake watcher failed: %s", strerror(errno));
+    }
+}
+
+void QDeviceReaderThread::beginDrain()
+{
+    quint64 value;
+    const ssize_t len = read(wake_fd, &value, sizeof(value));
+    Q_UNUSED(len);
+    //events pushed from now on need another drainReader()
+    drain_pending.storeRelease(0);
+}
+
+QDeviceUEventPrivate *QDeviceReaderThread::pop()
+{
+    QDeviceUEventPrivate *uevent = 0;
+    ring.pop(&uevent);
+    return uevent;
+}
+
+void QDeviceReaderThread::endDrain()
+{
+    if (space_fd != -1 && waiting.testAndSetOrdered(1, 0)) {
+        const quint64 one = 1;
+        if (write(space_fd, &one, sizeof(one)) < 0)
+            qWarning("wake reader thread failed: %s", strerror(errno));
+    }
+}
+
+void QDeviceWatcherPrivate::drainReader()
+{
+    if (!reader)
+        return;
+    reader->beginDrain();
+    while (source_fd != -1) { //a slot may stop the watcher
+        QDeviceUEventPrivate *d = reader->pop();
+        if (!d)
+            break;
+        names.intern(d);
+        dispatchUEvent(QDeviceUEvent(d));
+    }
+    reader->endDrain();
+    endBatch();
+}
 
 /**
  * Create new udev monitor and connect to a specified event
@@ -166,30 +1481,86 @@ void QDeviceWatcherPrivate::run()
  **/
 
 bool QDeviceWatcherPrivate::init()
+{
+    if (!recv_msgs) {
+        buffer.resize(UEVENT_BATCH_SIZE * UEVENT_MESSAGE_SIZE);
+        recv_msgs = new struct mmsghdr[UEVENT_BATCH_SIZE];
+        recv_iov = new struct iovec[UEVENT_BATCH_SIZE];
+        recv_addr = new struct sockaddr_nl[UEVENT_BATCH_SIZE];
+        recv_control = new char[UEVENT_BATCH_SIZE * UEVENT_CONTROL_SIZE];
+        memset(recv_msgs, 0, sizeof(struct mmsghdr) * UEVENT_BATCH_SIZE);
+        for (int i = 0; i < UEVENT_BATCH_SIZE; ++i) {
+            recv_msgs[i].msg_hdr.msg_name = &recv_addr[i];
+            recv_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_nl);
+            recv_iov[i].iov_base = buffer.data() + i * UEVENT_MESSAGE_SIZE;
+            recv_iov[i].iov_len = UEVENT_MESSAGE_SIZE;
+            recv_msgs[i].msg_hdr.msg_iov = &recv_iov[i];
+            recv_msgs[i].msg_hdr.msg_iovlen = 1;
+            recv_msgs[i].msg_hdr.msg_control = recv_control + i * UEVENT_CONTROL_SIZE;
+        }
+    }
+
+    if (!source)
+        source = new QDeviceNetlinkSource;
+    source_fd = source->open(this);
+    if (source_fd == -1)
+        return false;
+
+#if CONFIG_SOCKETNOTIFIER
+    if (!threaded) {
+        socket_notifier = new QSocketNotifier(source_fd, QSocketNotifier::Read, this);
+        connect(socket_notifier, SIGNAL(activated(int)), SLOT(parseDeviceInfo())); //will always active
+        socket_notifier->setEnabled(false);
+    }
+#elif CONFIG_TCPSOCKET
+    //QAbstractSocket *socket = new QAbstractSocket(QAbstractSocket::UnknownSocketType, this); //will not detect "remove", why?
+    tcp_socket = new QTcpSocket(this); //works too
+    if (!tcp_socket->setSocketDescriptor(source_fd, QAbstractSocket::ConnectedState)) {
+        qWarning("Failed to assign native socket to QAbstractSocket: %s",
+                 qPrintable(tcp_socket->errorString()));
+        delete tcp_socket;
+        return false;
+    }
+#endif
+    return true;
+}
+
+int QDeviceNetlinkSource::open(QDeviceWatcherPrivate *d)
 {
     struct sockaddr_nl snl;
-    const int buffersize = 16 * 1024 * 1024;
     int retval;
 
     memset(&snl, 0x00, sizeof(struct sockaddr_nl));
     snl.nl_family = AF_NETLINK;
-    snl.nl_groups = UDEV_MONITOR_KERNEL;
+    snl.nl_groups = d->netlink_group == QDeviceWatcher::UdevGroup ? UDEV_MONITOR_UDEV : UDEV_MONITOR_KERNEL;
 
-    netlink_socket = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
+    d->netlink_socket = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT);
     //netlink_socket = socket(PF_NETLINK, SOCK_DGRAM|SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT); //SOCK_CLOEXEC may be not available
-    if (netlink_socket == -1) {
+    if (d->netlink_socket == -1) {
         qWarning("error getting socket: %s", strerror(errno));
-        return false;
+        return -1;
     }
 
-    /* set receive buffersize */
-    setsockopt(netlink_socket, SOL_SOCKET, SO_RCVBUFFORCE, &buffersize, sizeof(buffersize));
-    retval = bind(netlink_socket, (struct sockaddr *) &snl, sizeof(struct sockaddr_nl));
+    d->attachFilter();
+
+    //kernel receive time of each datagram, to tell the time queued from our own
+    const int on = 1;
+    if (setsockopt(d->netlink_socket, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+        qWarning("SO_TIMESTAMPNS failed: %s", strerror(errno));
+    //credentials of the sender, to drop messages not sent by root
+    if (setsockopt(d->netlink_socket, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0)
+        qWarning("SO_PASSCRED failed: %s", strerror(errno));
+
+    /* set receive buffersize, adapted to the bursts later */
+    d->rcvbuf_force = true;
+    d->rcvbuf_quiet = 0;
+    d->rcvbuf_drops = 0;
+    d->setReceiveBuffer(d->rcvbuf_min);
+    retval = bind(d->netlink_socket, (struct sockaddr *) &snl, sizeof(struct sockaddr_nl));
     if (retval < 0) {
         qWarning("bind failed: %s", strerror(errno));
-        close(netlink_socket);
-        netlink_socket = -1;
-        return false;
+        close(d);
+        return -1;
     } else if (retval == 0) {
         //from libudev-monitor.c
         struct sockaddr_nl _snl;
@@ -200,66 +1571,317 @@ bool QDeviceWatcherPrivate::init()
 		 * it is usually, but not necessarily the pid
 		 */
         _addrlen = sizeof(struct sockaddr_nl);
-        retval = getsockname(netlink_socket, (struct sockaddr *) &_snl, &_addrlen);
+        retval = getsockname(d->netlink_socket, (struct sockaddr *) &_snl, &_addrlen);
         if (retval == 0)
             snl.nl_pid = _snl.nl_pid;
     }
+    return d->netlink_socket;
+}
 
-#if CONFIG_SOCKETNOTIFIER
-    socket_notifier = new QSocketNotifier(netlink_socket, QSocketNotifier::Read, this);
-    connect(socket_notifier, SIGNAL(activated(int)), SLOT(parseDeviceInfo())); //will always active
-    socket_notifier->setEnabled(false);
-#elif CONFIG_TCPSOCKET
-    //QAbstractSocket *socket = new QAbstractSocket(QAbstractSocket::UnknownSocketType, this); //will not detect "remove", why?
-    tcp_socket = new QTcpSocket(this); //works too
-    if (!tcp_socket->setSocketDescriptor(netlink_socket, QAbstractSocket::ConnectedState)) {
-        qWarning("Failed to assign native socket to QAbstractSocket: %s",
-                 qPrintable(tcp_socket->errorString()));
-        delete tcp_socket;
-        return false;
+int QDeviceNetlinkSource::receive(QDeviceWatcherPrivate *d)
+{
+    return d->receiveBatch(d->netlink_socket);
+}
+
+void QDeviceNetlinkSource::close(QDeviceWatcherPrivate *d)
+{
+    if (d->netlink_socket != -1)
+        ::close(d->netlink_socket);
+    d->netlink_socket = -1;
+}
+
+QDeviceFdSource::QDeviceFdSource(int fd)
+    : fd(fd)
+    , event_fd(-1)
+    , datagrams(false)
+    , started(false)
+{}
+
+int QDeviceFdSource::open(QDeviceWatcherPrivate *d)
+{
+    Q_UNUSED(d);
+    int type = 0;
+    socklen_t len = sizeof(type);
+    datagrams = getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 && (type == SOCK_DGRAM || type == SOCK_SEQPACKET);
+    if (datagrams) {
+        const int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
     }
-#endif
+    const int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        qWarning("invalid uevent source descriptor %d: %s", fd, strerror(errno));
+        return -1;
+    }
+    pending.clear();
+    started = false;
+    //epoll refuses regular files, which are always readable anyway. Read until the end instead
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        event_fd = eventfd(1, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (event_fd == -1)
+            qWarning("eventfd failed: %s", strerror(errno));
+        return event_fd;
+    }
+    return fd;
+}
+
+int QDeviceFdSource::receive(QDeviceWatcherPrivate *d)
+{
+    if (datagrams)
+        return d->receiveBatch(fd);
+    int total = 0;
+    char buf[UEVENT_BUFFER_SIZE * 8];
+    for (;;) {
+        const ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return total;
+        if (n <= 0) {
+            if (n < 0)
+                qWarning("read uevent source failed: %s", strerror(errno));
+            return -1;
+        }
+        d->counters.bytes.fetchAndAddRelaxed(n);
+        pending.append(buf, n);
+        int pos = 0;
+        int records = 0;
+        const int magic = sizeof(UEVENT_LOG_MAGIC) - 1;
+        if (!started && pending.size() >= magic) { //a log, as written by setRecordFile()
+            if (memcmp(pending.constData(), UEVENT_LOG_MAGIC, magic) == 0)
+                pos = magic;
+            started = true;
+        }
+        while (started && pending.size() - pos >= UEVENT_LOG_RECORD_HEADER) {
+            const quint32 size = qFromLittleEndian<quint32>(pending.constData() + pos);
+            if (size > UEVENT_MESSAGE_SIZE) {
+                qWarning("corrupt uevent stream, record of %u bytes", size);
+                return -1;
+            }
+            if (quint32(pending.size() - pos - UEVENT_LOG_RECORD_HEADER) < size)
+                break;
+            //as in a replay the recorded time is not the receive time
+            d->receiveUEvent(pending.constData() + pos + UEVENT_LOG_RECORD_HEADER, size);
+            pos += UEVENT_LOG_RECORD_HEADER + size;
+            ++records;
+        }
+        d->counters.datagrams.fetchAndAddRelaxed(records);
+        total += records;
+        pending.remove(0, pos);
+    }
+}
+
+void QDeviceFdSource::close(QDeviceWatcherPrivate *d)
+{
+    Q_UNUSED(d); //fd is owned by the user
+    if (event_fd != -1)
+        ::close(event_fd);
+    event_fd = -1;
+}
+
+QDeviceListSource::QDeviceListSource(const QList<QByteArray> &datagrams)
+    : datagrams(datagrams)
+    , next(0)
+    , event_fd(-1)
+{}
+
+int QDeviceListSource::open(QDeviceWatcherPrivate *d)
+{
+    Q_UNUSED(d);
+    next = 0; //fed again on every start()
+    event_fd = eventfd(datagrams.isEmpty() ? 0 : 1, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (event_fd == -1)
+        qWarning("eventfd failed: %s", strerror(errno));
+    return event_fd;
+}
+
+//a batch per call, so the event loop and the consumers keep up with any number of datagrams
+int QDeviceListSource::receive(QDeviceWatcherPrivate *d)
+{
+    const int end = qMin(datagrams.size(), next + UEVENT_BATCH_SIZE * 8);
+    const int count = end - next;
+    quint64 bytes = 0;
+    for (; next < end; ++next) {
+        const QByteArray &datagram = datagrams.at(next);
+        bytes += datagram.size();
+        d->receiveUEvent(datagram.constData(), datagram.size());
+    }
+    d->counters.datagrams.fetchAndAddRelaxed(count);
+    d->counters.bytes.fetchAndAddRelaxed(bytes);
+    if (next == datagrams.size()) { //not readable any more
+        quint64 value;
+        const ssize_t len = read(event_fd, &value, sizeof(value));
+        Q_UNUSED(len);
+    }
+    return count;
+}
+
+void QDeviceListSource::close(QDeviceWatcherPrivate *d)
+{
+    Q_UNUSED(d);
+    if (event_fd != -1)
+        ::close(event_fd);
+    event_fd = -1;
+}
+
+static inline struct sock_filter bpf_stmt(unsigned short code, quint32 k)
+{
+    struct sock_filter ins;
+    ins.code = code;
+    ins.jt = ins.jf = 0;
+    ins.k = k;
+    return ins;
+}
+
+static inline struct sock_filter bpf_jump(unsigned short code, quint32 k, unsigned char jt, unsigned char jf)
+{
+    struct sock_filter ins = bpf_stmt(code, k);
+    ins.jt = jt;
+    ins.jf = jf;
+    return ins;
+}
+
+//the first 4 bytes of "action@devpath" are different for every action
+static quint32 actionWord(QDeviceUEvent::Action action)
+{
+    static const char *const prefix[] = {"add@", "remo", "chan", "move", "onli", "offl", "bind", "unbi"};
+    const unsigned char *s = (const unsigned char *) prefix[action];
+    return (s[0] << 24) | (s[1] << 16) | (s[2] << 8) | s[3];
+}
+
+//load the word at offset and accept if it is any of values. Returns false if the jumps are too far
+static bool bpfMatchAny(QVector<struct sock_filter> *ins, quint32 offset, const QList<quint32> &values)
+{
+    if (values.isEmpty())
+        return true;
+    if (values.size() > 255)
+        return false;
+    ins->append(bpf_stmt(BPF_LD | BPF_W | BPF_ABS, offset));
+    for (int i = 0; i < values.size(); ++i) //jump over the "ret 0" if matched
+        ins->append(bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, values.at(i), values.size() - i, 0));
+    ins->append(bpf_stmt(BPF_RET | BPF_K, 0));
     return true;
 }
 
-void QDeviceWatcherPrivate::parseLine(const QByteArray &line)
+/*!
+  Attach a classic BPF program dropping unwanted messages in the kernel, so they never wake us up.
+  Kernel uevents are plain text with variable offsets, so only the action prefix can be matched.
+  udev messages carry subsystem and devtype hashes and a tag bloom filter at fixed offsets
+  in their header, the same program as libudev's udev_monitor_filter_update().
+*/
+bool QDeviceWatcherPrivate::attachFilter()
 {
-    zDebug("%s", line.constData());
-#define USE_REGEXP 0
-#if USE_REGEXP
-    QRegExp rx("(\\w+)(?:@/.*/block/.*/)(\\w+)\\W*");
-    //QRegExp rx("(add|remove|change)@/.*/block/.*/(\\w+)\\W*");
-    if (rx.indexIn(line) == -1)
-        return;
-    QString action_str = rx.cap(1).toLower();
-    QString dev = "/dev/" + rx.cap(2);
-#else
-    /*!
-    if (!line.contains("/block/")) //hotplug
-        return; !*/
-    QString action_str = line.left(line.indexOf('@')).toLower();
-    QString dev = "/dev/" + line.right(line.length() - line.lastIndexOf('/') - 1);
-#endif //USE_REGEXP
-    QDeviceChangeEvent *event = 0;
+    typedef QDeviceUEventPrivate::UdevHeader UdevHeader;
+    if (netlink_socket == -1)
+        return true;
+    QVector<struct sock_filter> ins;
+    bool ok = true;
+    if (netlink_group == QDeviceWatcher::UdevGroup) {
+        if (!subsystem_hashes.isEmpty() || !devtype_hashes.isEmpty() || !tag_blooms.isEmpty()) {
+            //not a libudev message: pass it, the parser rejects it
+            ins.append(bpf_stmt(BPF_LD | BPF_W | BPF_ABS, offsetof(UdevHeader, magic)));
+            ins.append(bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, UDEV_MONITOR_MAGIC, 1, 0));
+            ins.append(bpf_stmt(BPF_RET | BPF_K, 0xffffffff));
+            ok = bpfMatchAny(&ins, offsetof(UdevHeader, filter_subsystem_hash), subsystem_hashes)
+                 && bpfMatchAny(&ins, offsetof(UdevHeader, filter_devtype_hash), devtype_hashes);
+            const int t = tag_blooms.size();
+            if (t > 0 && 6 * t > 255)
+                ok = false;
+            for (int j = 0; ok && j < t; ++j) {
+                const quint64 bloom = tag_blooms.at(j);
+                const quint32 hi = bloom >> 32;
+                const quint32 lo = bloom & 0xffffffff;
+                //all bits of the tag set in both halves: jump to the last "ret", otherwise try the next tag
+                ins.append(bpf_stmt(BPF_LD | BPF_W | BPF_ABS, offsetof(UdevHeader, filter_tag_bloom_hi)));
+                ins.append(bpf_stmt(BPF_ALU | BPF_AND | BPF_K, hi));
+                ins.append(bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, hi, 0, 3));
+                ins.append(bpf_stmt(BPF_LD | BPF_W | BPF_ABS, offsetof(UdevHeader, filter_tag_bloom_lo)));
+                ins.append(bpf_stmt(BPF_ALU | BPF_AND | BPF_K, lo));
+                ins.append(bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, lo, 6 * (t - j) - 5, 0));
+            }
+            if (t > 0)
+                ins.append(bpf_stmt(BPF_RET | BPF_K, 0));
+        }
+    } else if (!action_filter.isEmpty() && !action_filter.contains(QDeviceUEvent::Unknown)) {
+        QList<quint32> words;
+        foreach (QDeviceUEvent::Action action, action_filter) {
+            if (!words.contains(actionWord(action)))
+                words.append(actionWord(action));
+        }
+        ok = bpfMatchAny(&ins, 0, words);
+    }
+    if (!ok)
+        qWarning("too many filters for a socket filter, filtering in user space");
+    //events dropped before parsing do not count as missed. udevd workers broadcast finished
+    //events out of SEQNUM order, so a gap there is no loss
+    track_seqnum = (ins.isEmpty() || !ok) && netlink_group != QDeviceWatcher::UdevGroup;
+    last_seqnum = 0;
+    if (ins.isEmpty() || !ok) {
+        setsockopt(netlink_socket, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0); //ENOENT if nothing attached
+        return ok;
+    }
+    ins.append(bpf_stmt(BPF_RET | BPF_K, 0xffffffff));
 
-    if (action_str == QLatin1String("add")) {
-        emitDeviceAdded(dev);
-        event = new QDeviceChangeEvent(QDeviceChangeEvent::Add, dev);
-    } else if (action_str == QLatin1String("remove")) {
-        emitDeviceRemoved(dev);
-        event = new QDeviceChangeEvent(QDeviceChangeEvent::Remove, dev);
-    } else if (action_str == QLatin1String("change")) {
-        emitDeviceChanged(dev);
-        event = new QDeviceChangeEvent(QDeviceChangeEvent::Change, dev);
+    struct sock_fprog filter;
+    memset(&filter, 0, sizeof(filter));
+    filter.len = ins.size();
+    filter.filter = ins.data();
+    if (setsockopt(netlink_socket, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) < 0) {
+        qWarning("attach socket filter failed: %s", strerror(errno));
+        return false;
     }
+    return true;
+}
 
-    zDebug("%s %s", qPrintable(action_str), qPrintable(dev));
+void QDeviceWatcherPrivate::receiveUEvent(const char *data, int size, qint64 timestamp)
+{
+    if (recorder.isOpen())
+        recorder.append(data, size, timestamp ? timestamp : QDeviceUEventPrivate::currentTime());
+    parseUEvent(data, size, timestamp);
+}
 
-    if (event != 0 && !event_receivers.isEmpty()) {
-        foreach (QObject *obj, event_receivers) {
-            QCoreApplication::postEvent(obj, event, Qt::HighEventPriority);
+void QDeviceWatcherPrivate::parseUEvent(const char *data, int size, qint64 timestamp)
+{
+    QElapsedTimer timer;
+    timer.start();
+    QDeviceUEventPrivate::UdevHeader header;
+    if (QDeviceUEventPrivate::udevHeader(data, size, &header) && !matchUdevHeader(header)) {
+        counters.filtered.fetchAndAddRelaxed(1);
+        return; //rejected without parsing the properties
+    }
+    QDeviceUEventPrivate fields;
+    if (!fields.parse(data, size))
+        return;
+    //synthetic events (coldplug, resync) have no SEQNUM
+    if (fields.seqnum && track_seqnum) {
+        if (last_seqnum && fields.seqnum > last_seqnum + 1) {
+            qWarning("missed %llu uevents, resynchronising", (unsigned long long) (fields.seqnum - last_seqnum - 1));
+            counters.missed.fetchAndAddRelaxed(fields.seqnum - last_seqnum - 1);
+            events_lost.storeRelease(1);
         }
+        if (fields.seqnum > last_seqnum) //never backwards, a late event is no second gap
+            last_seqnum = fields.seqnum;
+    }
+    if (!matchFilters(fields, data)) {
+        counters.filtered.fetchAndAddRelaxed(1);
+        counters.parse_time.add(timer.nsecsElapsed());
+        return;
+    }
+    QDeviceUEventPrivate *d = new QDeviceUEventPrivate(fields); //pooled, no allocation in steady state
+    d->setRaw(data, size);
+    d->timestamp = timestamp;
+    counters.parse_time.add(timer.nsecsElapsed());
+    if (timestamp) {
+        const qint64 latency = QDeviceUEventPrivate::currentTime() - timestamp;
+        if (latency >= 0)
+            counters.receive_latency.add(latency);
+    }
+    if (reader && QThread::currentThread() == reader) {
+        reader->push(d); //dispatched in drainReader()
+        return;
     }
+    names.intern(d);
+    dispatchUEvent(QDeviceUEvent(d));
 }
 
 #endif //Q_OS_LINUX
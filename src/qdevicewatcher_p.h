@@ -30,7 +30,7 @@
 #if defined(Q_OS_WINCE)
 #define CONFIG_THREAD 1
 #elif defined(Q_OS_LINUX)
-#define CONFIG_THREAD (!CONFIG_SOCKETNOTIFIER && !CONFIG_TCPSOCKET)
+#define CONFIG_THREAD 0 //see QDeviceWatcher::setReaderThreadEnabled()
 #elif defined Q_OS_MAC //OSX or MACX
 #define CONFIG_THREAD 1
 #include <DiskArbitration/DiskArbitration.h>
@@ -46,13 +46,634 @@
 
 #ifdef Q_OS_WIN
 #include <qt_windows.h>
-#else
-#include <QtCore/QBuffer>
 #endif //Q_OS_WIN
+#include <QtCore/QAtomicInt>
+#include <QtCore/QAtomicPointer>
+#include <QtCore/QByteArray>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
 #include <QtCore/QList>
+#include <QtCore/QMutex>
+#include <QtCore/QVector>
+#include <QtCore/QSharedData>
 #include <QtCore/QThread>
+#include <string.h>
+#include "qdevicewatcher.h"
+
+/*!
+  Fields of a parsed uevent. parse() walks the datagram in place and only records offsets,
+  so a datagram can be inspected (e.g. filtered) before anything is copied.
+  Offsets are relative to the parsed data, which becomes raw when the event is kept.
+*/
+class QDeviceUEventPrivate : public QSharedData
+{
+public:
+    //binary header of messages in the "udev" netlink group, see libudev-monitor.c
+#define UDEV_MONITOR_MAGIC 0xfeedcafe
+    struct UdevHeader
+    {
+        char prefix[8]; //"libudev"
+        quint32 magic;  //0xfeedcafe, big endian
+        quint32 header_size;
+        quint32 properties_off;
+        quint32 properties_len;
+        quint32 filter_subsystem_hash; //big endian
+        quint32 filter_devtype_hash;   //big endian
+        quint32 filter_tag_bloom_hi;   //big endian
+        quint32 filter_tag_bloom_lo;   //big endian
+    };
+
+    struct Field
+    {
+        int offset;
+        int size; //-1: not present
+        bool isNull() const { return size < 0; }
+    };
+
+    QDeviceUEventPrivate()
+        : action(QDeviceUEvent::Unknown)
+        , properties(0)
+        , properties_end(0)
+        , dev_major(0)
+        , dev_minor(0)
+        , seqnum(0)
+        , timestamp(0)
+    {
+        action_name.offset = devpath.offset = subsystem.offset = devtype.offset = devname.offset = tags.offset = 0;
+        action_name.size = devpath.size = subsystem.size = devtype.size = devname.size = tags.size = -1;
+    }
+    QDeviceUEventPrivate(const QDeviceUEventPrivate &other);
+
+    //kernel uevents are at most 2048 bytes, larger ones (udev) are copied to the heap
+    enum { InlineSize = 2048 };
+    //from a pool, every block has InlineSize bytes behind the object for raw
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr, size_t size);
+    //copies the datagram behind the object if it fits, raw then points there. Only for
+    //objects from operator new, i.e. not on the stack
+    void setRaw(const char *data, int size);
+    //"/dev/" + DEVNAME or the last devpath component, built from raw
+    QString nodeName() const;
+    bool isInline() const { return raw.constData() == reinterpret_cast<const char *>(this + 1); }
+
+    bool parse(const char *data, int size);
+    //points into raw, valid as long as raw is
+    QByteArray field(const Field &f) const
+    {
+        return f.isNull() ? QByteArray() : QByteArray::fromRawData(raw.constData() + f.offset, f.size);
+    }
+    //the private of every default constructed (invalid) event, never deleted
+    static QDeviceUEventPrivate *sharedNull();
+    static QDeviceUEvent::Action actionFromName(const char *name, int size);
+    static bool udevHeader(const char *data, int size, UdevHeader *header);
+    //the same hash and bloom filter as udev, used in the udev message header
+    static quint32 hash32(const char *s, int size);
+    static quint64 bloom64(const char *s, int size);
+    //ns since the epoch, the clock of the kernel receive timestamps
+    static qint64 currentTime();
+
+    QByteArray raw;
+    QString node; //interned by QDeviceNameTable, or the only field if not Linux
+    QDeviceUEvent::Action action;
+    Field action_name;
+    Field devpath;
+    Field subsystem;
+    Field devtype;
+    Field devname;
+    Field tags;
+    int properties; //offset of the first KEY=VALUE
+    int properties_end;
+    int dev_major;
+    int dev_minor;
+    quint64 seqnum;
+    qint64 timestamp; //kernel receive time, ns since the epoch. 0 if unknown
+};
+
+//devpath a is p or one of its ancestors
+static inline bool isDevPathAncestor(const char *a, int a_size, const char *p, int p_size)
+{
+    return a_size <= p_size && memcmp(a, p, a_size) == 0 && (a_size == p_size || p[a_size] == '/');
+}
+
+/*!
+  Known devices, updated from the reported events. Devices are stored densely in a vector,
+  the hashes map devpath, device node and dev_t to an index in it. Removing swaps the last
+  device into the hole, so lookups stay a hash probe plus one array access.
+  tree is parallel to the vector and links every device to its nearest known ancestor by
+  devpath, with intrusive child lists. Adding a device finds its parent by probing the
+  prefixes of its devpath and adopts the parent's children below it, removing one hands its
+  children to its parent. Change events touch neither.
+*/
+class QDeviceRegistry
+{
+public:
+    QDeviceRegistry()
+        : first_root(-1)
+    {}
+    void update(const QDeviceUEvent &uevent);
+    void clear();
+    int indexOf(const QString &devPathOrNode) const;
+    int indexOf(quint64 devNum) const;
+    int indexOfDevPath(const QByteArray &devpath) const { return by_devpath.value(devpath, -1); }
+    const QVector<QDeviceUEvent> &devices() const { return list; }
+    //copies the devices into the own vector, so the two never share one and detach
+    void assign(const QDeviceRegistry &other);
+    //-1 if none
+    int parentOf(int index) const { return tree.at(index).parent; }
+    QVector<int> childrenOf(int index) const;
+    //pre-order: every device before its children
+    QVector<int> descendantsOf(int index) const;
+
+private:
+    void insert(const QDeviceUEvent &uevent);
+    void removeAt(int index);
+    static bool sameKeys(const QDeviceUEventPrivate *a, const QDeviceUEventPrivate *b);
+    int nearestAncestor(const char *path, int size) const;
+    //adds delta to the count of every devpath prefix above path
+    void countBelow(const char *path, int size, int delta);
+    //into the child list of parent, the roots if -1
+    void link(int index, int parent);
+    void unlink(int index);
+
+    struct Node
+    {
+        int parent;
+        int first_child;
+        int prev; //siblings
+        int next;
+    };
+    QVector<Node> tree;
+    int first_root;
+    QHash<QByteArray, int> below; //known devices below a devpath, only the ones with any
+
+    QVector<QDeviceUEvent> list;
+    QHash<QByteArray, int> by_devpath;
+    QHash<QString, int> by_node;
+    QHash<quint64, int> by_devnum;
+};
+
+class QDeviceSnapshotPrivate : public QSharedData
+{
+public:
+    QDeviceSnapshotPrivate()
+        : generation(0)
+    {}
+
+    QDeviceRegistry registry; //the writer's devices, hashes shared until they change
+    quint64 generation;
+};
+
+/*!
+  Publishes snapshots of the registry RCU style. There is one writer (the watcher) and any
+  number of readers in any thread. A reader registers in the reader counter of the current
+  epoch before it loads the pointer and takes a reference. The writer swaps the pointer, flips
+  the epoch and waits until no reader of the previous epoch is left, only then it drops the
+  reference of the old snapshot. Readers never wait, the writer waits a few instructions at most.
+  If no reader kept the old snapshot it is reused by the next publish, with the capacity of its
+  vector, so steady-state publishing does not allocate. A publish copies the registry: a
+  reference per device, the devices themselves are shared, and the hashes are shared until
+  the registry changes next. So it is O(devices) per batch that changed the registry.
+*/
+class QDeviceSnapshotPublisher
+{
+public:
+    QDeviceSnapshotPublisher();
+    ~QDeviceSnapshotPublisher();
+    void publish(const QDeviceRegistry &registry);
+    QDeviceSnapshot acquire() const;
+
+private:
+    Q_DISABLE_COPY(QDeviceSnapshotPublisher)
+    QAtomicPointer<QDeviceSnapshotPrivate> current;
+    mutable QAtomicInt readers[2];
+    QAtomicInt epoch;
+    quint64 generation;
+    QDeviceSnapshotPrivate *spare; //retired and not referenced, or 0
+};
+
+/*!
+  Lock-free ring for exactly one producer thread and one consumer thread. Size must be a
+  power of 2. head is only written by the producer, tail only by the consumer, each on its
+  own cache line. A slot is published by the release store of head and freed by the
+  release store of tail.
+*/
+template <typename T, int Size>
+class QSpscRing
+{
+public:
+    QSpscRing()
+        : head(0)
+        , tail(0)
+    {}
+    bool isEmpty() const { return head.loadAcquire() == tail.loadAcquire(); }
+    int size() const { return head.loadAcquire() - tail.loadAcquire(); }
+    //producer. false if full
+    bool push(const T &value)
+    {
+        const quint32 h = head.loadRelaxed();
+        if (h - tail.loadAcquire() == Size)
+            return false;
+        items[h & (Size - 1)] = value;
+        head.storeRelease(h + 1);
+        return true;
+    }
+    //consumer. false if empty
+    bool pop(T *value)
+    {
+        const quint32 t = tail.loadRelaxed();
+        if (head.loadAcquire() == t)
+            return false;
+        *value = items[t & (Size - 1)];
+        tail.storeRelease(t + 1);
+        return true;
+    }
+
+private:
+    Q_DISABLE_COPY(QSpscRing)
+    T items[Size];
+    QAtomicInteger<quint32> head;
+    char pad[64];
+    QAtomicInteger<quint32> tail;
+};
+
+//log2 buckets of durations in nanoseconds
+class QDeviceHistogram
+{
+public:
+    void add(quint64 ns)
+    {
+        int i = ns ? 63 - qCountLeadingZeroBits(ns) : 0;
+        if (i >= QDeviceWatcherStatistics::HistogramBuckets)
+            i = QDeviceWatcherStatistics::HistogramBuckets - 1;
+        buckets[i].fetchAndAddRelaxed(1);
+    }
+    void copyTo(quint64 *to) const
+    {
+        for (int i = 0; i < QDeviceWatcherStatistics::HistogramBuckets; ++i)
+            to[i] = buckets[i].loadRelaxed();
+    }
+
+private:
+    QAtomicInteger<quint64> buckets[QDeviceWatcherStatistics::HistogramBuckets];
+};
+
+/*!
+  Counters behind QDeviceWatcher::statistics(). Updated with relaxed atomics in the receiving
+  thread and the watcher's thread, nothing is ordered by them. The high-water marks have one
+  writer each, the receiving thread.
+*/
+struct QDeviceWatcherCounters
+{
+    QAtomicInteger<quint64> datagrams;
+    QAtomicInteger<quint64> bytes;
+    QAtomicInteger<quint64> events[QDeviceUEvent::Unknown + 1];
+    QAtomicInteger<quint64> filtered;
+    QAtomicInteger<quint64> overflows;
+    QAtomicInteger<quint64> missed;
+    QAtomicInteger<quint64> coalesced;
+    QAtomicInt queue_high_water;
+    QAtomicInt rcvbuf_high_water;
+    QDeviceHistogram parse_time;
+    QDeviceHistogram dispatch_time;
+    QDeviceHistogram receive_latency;
+    QDeviceHistogram delivery_latency;
+};
 
 class QDeviceWatcher;
+class QDeviceWatcherPrivate;
+
+#if defined(Q_OS_LINUX)
+/*!
+  Holds the events of a device for a window and merges the ones that follow: add and change is
+  an add with the properties of the change, add and remove cancel out, changes collapse into
+  the last one. Deadlines are kept in a timer wheel of Slots ticks and a window is at most
+  Slots / 2 ticks, so a single timer ticking while anything is held serves all devices, and
+  expiring a tick only visits its slot. Only used in the watcher's thread.
+*/
+class QDeviceCoalescer
+{
+public:
+    enum { Slots = 64 };
+    QDeviceCoalescer();
+    //discards held events. 0 disables
+    void setWindow(int msecs);
+    int window() const { return window_ms; }
+    int tickInterval() const { return tick_ms; }
+    bool isEmpty() const { return held.isEmpty(); }
+    void clear();
+    //events to deliver now are appended to ready. Returns the number of events merged away
+    int add(const QDeviceUEvent &uevent, QList<QDeviceUEvent> *ready);
+    //advances one tick, the events due are appended to ready
+    void tick(QList<QDeviceUEvent> *ready);
+
+private:
+    struct Held
+    {
+        QDeviceUEvent uevent;
+        quint64 deadline; //tick
+    };
+    QHash<QByteArray, Held> held; //by devpath
+    QVector<QByteArray> wheel[Slots];
+    quint64 now; //ticks so far
+    int window_ms;
+    int tick_ms;
+    int window_ticks;
+};
+
+/*!
+  Groups the events of physical devices by devpath ancestry. sysfs nests devices the way they
+  are connected, so everything a USB disk brings is below the devpath of its usb_device. An
+  add (remove) at or below the root of an open add (remove) transaction joins it, one above
+  becomes the new root and merges all transactions below it, e.g. a hub removed after its
+  devices. Other actions join a transaction containing them. A transaction has settled when
+  none of its devices had an event for the settle interval. A device removed before its add
+  transaction settled is dropped with everything below it, it is neither arrived nor departed.
+  Only used in the watcher's thread.
+*/
+class QDeviceTransactions
+{
+public:
+    struct Transaction
+    {
+        QByteArray root;
+        QDeviceUEvent::Action action; //Add or Remove
+        QList<QDeviceUEvent> members;
+        QVector<quint64> arrivals; //of the members, ascending
+        qint64 deadline; //ms
+    };
+    QDeviceTransactions()
+        : settle(0)
+        , arrivals(0)
+    {}
+    //discards open transactions. 0 disables
+    void setSettleInterval(int msecs);
+    int settleInterval() const { return settle; }
+    bool isEmpty() const { return open.isEmpty(); }
+    void clear() { open.clear(); }
+    //now in ms
+    void add(const QDeviceUEvent &uevent, qint64 now);
+    //removes and returns the settled ones, in the order they were opened
+    QList<Transaction> takeSettled(qint64 now);
+    //the earliest deadline, -1 if none is open
+    qint64 nextDeadline() const;
+
+private:
+    //merges the members of from into into, by arrival
+    static void merge(Transaction *into, const Transaction &from);
+    //an add transaction of root and what was removed below it meanwhile. True if one was open
+    bool cancel(const char *root, int size);
+
+    QList<Transaction> open;
+    int settle;
+    quint64 arrivals; //events added so far
+};
+
+/*!
+  sysfs attributes of known devices. The directory of a device is opened once, attributes are
+  read with openat() relative to it on first access, so a path is resolved once per device
+  instead of once per read. Any event of the device drops its values, add, remove and move
+  also close the directory, since the path may name another device then. Read from any
+  thread, invalidated from the watcher's. The lock is not held while sysfs is read, a hung
+  device only blocks its own reader.
+*/
+class QDeviceAttributeCache
+{
+public:
+    enum { MaxDirs = 256 }; //open directory fds at most
+    QDeviceAttributeCache() {}
+    ~QDeviceAttributeCache() { closeAll(); }
+    //devpath may point into an event
+    QByteArray value(const QByteArray &devpath, const QByteArray &name);
+    void invalidate(const QByteArray &devpath, bool closeDir);
+    void clear();
+
+private:
+    Q_DISABLE_COPY(QDeviceAttributeCache)
+    void closeAll(); //with the lock held
+    struct Entry
+    {
+        Entry()
+            : dirfd(-1)
+        {}
+        int dirfd;
+        QHash<QByteArray, QByteArray> values; //null: no such attribute
+    };
+    QMutex mutex;
+    QHash<QByteArray, Entry> entries; //by devpath
+    QAtomicInt used; //entries is not empty, skips the lock for every event otherwise
+    QAtomicInt generation; //of invalidations, a read outside the lock is cached if unchanged
+};
+
+/*!
+  The mount table from /proc/self/mountinfo, by mount id and by major:minor. update() is given
+  the whole file after the kernel signalled a change. A line with a known mount id and the same
+  hash as before is not parsed again, so a change costs a scan and a hash per line. Anonymous
+  devices (major 0, e.g. tmpfs or proc) are kept with devnum 0 for that and never reported,
+  unless the mount source is a block device node, as for btrfs. Updated in the watcher's
+  thread, queried from any.
+*/
+class QDeviceMountTable
+{
+public:
+    struct Mount
+    {
+        int id;
+        quint64 devnum; //0 if not a block device
+        QByteArray mount_point; //unescaped
+        quint32 line_hash;
+    };
+    QDeviceMountTable() {}
+    //the changes are appended to mounted and unmounted, a moved mount is in both
+    void update(const char *data, int size, QList<Mount> *mounted, QList<Mount> *unmounted);
+    QList<QByteArray> mountPoints(quint64 devnum) const;
+    void clear();
+
+private:
+    Q_DISABLE_COPY(QDeviceMountTable)
+    static bool parse(const char *line, const char *end, Mount *mount);
+    mutable QMutex mutex; //only for writing and for other threads
+    QHash<int, Mount> mounts; //by mount id
+    QMultiHash<quint64, int> by_devnum;
+};
+
+/*!
+  Interned device nodes. The few hundred devices of a system report events over and over,
+  polled drives a change every few seconds, so the node string of a device is built once and
+  shared by all its events: no allocation and no UTF-16 conversion per event, and the nodes of
+  one device share their data, so they compare by pointer. Keyed by the raw DEVNAME, or the
+  devpath if there is none. A remove evicts the device, its events keep their reference.
+  Only used in the watcher's thread.
+*/
+class QDeviceNameTable
+{
+public:
+    enum { MaxSize = 8192 }; //bounds names of devices that are never removed, e.g. moved
+    //sets d->node
+    void intern(QDeviceUEventPrivate *d);
+    void clear() { names.clear(); }
+
+private:
+    QHash<QByteArray, QString> names;
+};
+
+/*!
+  Where uevents come from. open() returns a descriptor that is readable while uevents are
+  pending, it is polled by the socket notifier or the reader thread. receive() passes the
+  pending datagrams to QDeviceWatcherPrivate::receiveUEvent() and returns how many, or -1 at
+  the end of the stream or on error, then the descriptor is not polled any more.
+*/
+class QDeviceUEventSource
+{
+public:
+    virtual ~QDeviceUEventSource() {}
+    virtual int open(QDeviceWatcherPrivate *d) = 0;
+    virtual int receive(QDeviceWatcherPrivate *d) = 0;
+    virtual void close(QDeviceWatcherPrivate *d) = 0;
+};
+
+//NETLINK_KOBJECT_UEVENT socket of the netlink group
+class QDeviceNetlinkSource : public QDeviceUEventSource
+{
+public:
+    virtual int open(QDeviceWatcherPrivate *d);
+    virtual int receive(QDeviceWatcherPrivate *d);
+    virtual void close(QDeviceWatcherPrivate *d);
+};
+
+/*!
+  uevent stream and log format, UEVENT_LOG_MAGIC then a record per datagram: 32 bit size,
+  64 bit receive time in ns since the epoch, both little endian, and the datagram itself.
+  Written by QDeviceUEventRecorder, read by QDeviceReplaySource and QDeviceFdSource.
+*/
+#define UEVENT_LOG_MAGIC "QDWUEV01"
+#define UEVENT_LOG_RECORD_HEADER 12
+
+/*!
+  A descriptor opened by the user, which is not closed. A datagram socket carries a uevent
+  per datagram, a stream the records of a log, the magic is optional. A regular file is
+  read to its end at once, an eventfd stands in for it, as epoll and the notifiers can not
+  wait for files.
+*/
+class QDeviceFdSource : public QDeviceUEventSource
+{
+public:
+    explicit QDeviceFdSource(int fd);
+    virtual int open(QDeviceWatcherPrivate *d);
+    virtual int receive(QDeviceWatcherPrivate *d);
+    virtual void close(QDeviceWatcherPrivate *d);
+
+private:
+    int fd;
+    int event_fd; //readable, for a regular file
+    bool datagrams;
+    bool started; //the magic is skipped
+    QByteArray pending; //incomplete records of a stream
+};
+
+//datagrams in memory. An eventfd is readable until all are received, a batch per receive()
+class QDeviceListSource : public QDeviceUEventSource
+{
+public:
+    explicit QDeviceListSource(const QList<QByteArray> &datagrams);
+    virtual int open(QDeviceWatcherPrivate *d);
+    virtual int receive(QDeviceWatcherPrivate *d);
+    virtual void close(QDeviceWatcherPrivate *d);
+
+private:
+    QList<QByteArray> datagrams;
+    int next;
+    int event_fd;
+};
+
+//appends to a log, written once per receive cycle. Only used in the receiving thread
+class QDeviceUEventRecorder
+{
+public:
+    QDeviceUEventRecorder()
+        : fd(-1)
+    {}
+    ~QDeviceUEventRecorder() { close(); }
+    bool open(const QByteArray &fileName);
+    void append(const char *data, int size, qint64 timestamp);
+    void flush();
+    void close();
+    bool isOpen() const { return fd != -1; }
+
+private:
+    Q_DISABLE_COPY(QDeviceUEventRecorder)
+    int fd;
+    QByteArray buffer;
+};
+
+/*!
+  Replays a log. The file is mapped and the records are parsed in place. A timerfd is armed
+  for the next record at its original time scaled by 1/speed, speed 0 replays as fast as
+  possible, a batch per receive().
+*/
+class QDeviceReplaySource : public QDeviceUEventSource
+{
+public:
+    QDeviceReplaySource(const QByteArray &fileName, qreal speed);
+    ~QDeviceReplaySource();
+    virtual int open(QDeviceWatcherPrivate *d);
+    virtual int receive(QDeviceWatcherPrivate *d);
+    virtual void close(QDeviceWatcherPrivate *d);
+
+private:
+    void arm(qint64 due);
+
+    QByteArray file_name;
+    qreal speed;
+    int timer_fd;
+    const char *map;
+    qint64 map_size;
+    qint64 pos;
+    qint64 start; //CLOCK_MONOTONIC ns when the replay started
+    qint64 first; //time of the first record
+};
+
+/*!
+  Receives and parses uevents in its own thread, blocked in epoll_wait() on the netlink
+  socket and an eventfd. stop() writes the eventfd, so the thread wakes up and exits at
+  once even if nothing arrives, before the socket is closed. Parsed events are handed to
+  the watcher's thread through a QSpscRing and drained there once per received batch, the
+  watcher is woken through a third eventfd, which does not allocate. If the ring is full the thread stops reading and the kernel queues the datagrams.
+*/
+class QDeviceReaderThread : public QThread
+{
+public:
+    explicit QDeviceReaderThread(QDeviceWatcherPrivate *d);
+    ~QDeviceReaderThread();
+    bool start(int fd);
+    void stop();
+    //reader thread. Waits while the ring is full, false if stopped meanwhile
+    bool push(QDeviceUEventPrivate *uevent);
+    //watcher's thread, pop() between beginDrain() and endDrain()
+    void beginDrain();
+    QDeviceUEventPrivate *pop();
+    void endDrain();
+    int queueDepth() const { return ring.size(); }
+    //readable while a drain is requested, for a QSocketNotifier of the watcher
+    int wakeDescriptor() const { return wake_fd; }
+
+protected:
+    virtual void run();
+
+private:
+    void requestDrain();
+
+    QDeviceWatcherPrivate *d;
+    int socket;
+    int epoll_fd;
+    int cancel_fd; //eventfd, written by stop()
+    int space_fd;  //eventfd, written by endDrain() if the reader waits for space
+    int wake_fd;   //eventfd, written by requestDrain(), read by beginDrain()
+    QAtomicInt drain_pending; //wake_fd was written and no drain began since
+    QAtomicInt waiting;       //the ring was full
+    QSpscRing<QDeviceUEventPrivate *, 1024> ring;
+};
+#endif //Q_OS_LINUX
+
 class QDeviceWatcherPrivate
 #if CONFIG_THREAD
     : public QThread
@@ -70,6 +691,40 @@ public:
         QObject(parent)
 #endif //CONFIG_THREAD
     {
+#if defined(Q_OS_LINUX)
+        netlink_socket = -1;
+        source_fd = -1;
+        source = 0;
+        recv_addr = 0;
+        recv_msgs = 0;
+        recv_iov = 0;
+        recv_control = 0;
+#if CONFIG_SOCKETNOTIFIER
+        socket_notifier = 0;
+#endif //CONFIG_SOCKETNOTIFIER
+        reader = 0;
+        drain_notifier = 0;
+        coalesce_timer = 0;
+        settle_timer = 0;
+        mountinfo_fd = -1;
+        mount_notifier = 0;
+        last_seqnum = 0;
+        track_seqnum = true;
+        rcvbuf = 0;
+        rcvbuf_force = true;
+        rcvbuf_quiet = 0;
+        rcvbuf_drops = 0;
+#endif //Q_OS_LINUX
+        rcvbuf_min = 128 * 1024;
+        rcvbuf_max = 16 * 1024 * 1024;
+        threaded = false;
+        coalesce_window = 0;
+        settle_interval = 0;
+        netlink_group = QDeviceWatcher::KernelGroup;
+        coldplug = false;
+        mount_tracking = false;
+        delivery = QDeviceWatcher::PerDeviceDelivery | QDeviceWatcher::BatchDelivery;
+        registry_changed = false;
         //init();
     }
     ~QDeviceWatcherPrivate();
@@ -78,16 +733,118 @@ public:
     bool start(); //conflict with QThread::start()
     bool stop();
 
-    //Do not use Qt::DirectConnection. this thread is not watcher's thread!
-    void emitDeviceAdded(const QString &dev);
-    void emitDeviceChanged(const QString &dev); //Linux: when umounting the device
-    void emitDeviceRemoved(const QString &dev);
-    void emitDeviceAction(const QString &dev, const QString &action);
+    /*!
+      Emitted directly if called in watcher's thread, otherwise queued to watcher's thread
+      through a QMetaMethod resolved once. No lookup by name and no string compare per event.
+      Do not use Qt::DirectConnection. this thread may not be watcher's thread!
+    */
+    void emitDeviceAdded(const QString &dev) { emitDeviceAction(dev, QDeviceUEvent::Add); }
+    void emitDeviceChanged(const QString &dev) { emitDeviceAction(dev, QDeviceUEvent::Change); }
+    void emitDeviceRemoved(const QString &dev) { emitDeviceAction(dev, QDeviceUEvent::Remove); }
+    void emitDeviceAction(const QString &dev, QDeviceUEvent::Action action);
+    void emitDevicesChanged(const QList<QDeviceUEvent> &uevents);
+    void emitEventsLost();
+    void postDeviceChangeEvent(const QDeviceUEvent &uevent);
+    //update the registry, then deliver or hold it in the coalescer
+    void dispatchUEvent(const QDeviceUEvent &uevent);
+    //per device or add to the batch
+    void deliverUEvent(const QDeviceUEvent &uevent);
+    //publish the registry and deliver the batch. Called once per receive cycle
+    void endBatch();
 
     QList<QObject *> event_receivers;
+    QDeviceWatcherCounters counters;
+    QDeviceRegistry registry; //only touched by the watcher, readers use snapshots
+    QDeviceSnapshotPublisher snapshots;
+    bool registry_changed;
+    void updateRegistry(const QDeviceUEvent &uevent);
+    void publishDevices();
+    //false while the reader thread matches the filters, they are not locked
+    bool canChangeFilters() const;
+    QList<QDeviceUEvent::Action> action_filter;
+    QList<QByteArray> subsystem_filter;
+    QList<QByteArray> devtype_filter;
+    QList<QByteArray> tag_filter;
+    QList<quint32> subsystem_hashes;
+    QList<quint32> devtype_hashes;
+    QList<quint64> tag_blooms;
+    QDeviceWatcher::NetlinkGroup netlink_group;
+    bool coldplug;
+    bool mount_tracking;
+    bool threaded;
+    int coalesce_window; //ms
+    int settle_interval; //ms
+    int rcvbuf_min;
+    int rcvbuf_max;
+    QAtomicInt rcvbuf_size; //granted by the kernel, read from any thread
+    QDeviceWatcher::DeliveryFlags delivery;
+    QList<QDeviceUEvent> batch;
+    bool matchUdevHeader(const QDeviceUEventPrivate::UdevHeader &header) const;
+    bool matchFilters(const QDeviceUEventPrivate &uevent, const char *data) const;
+#if defined(Q_OS_LINUX)
+    bool attachFilter();
+    bool setSource(QDeviceUEventSource *s);
+    int receiveBatch(int fd);
+    void parseUEvent(const char *data, int size, qint64 timestamp = 0);
+    //a datagram from the source: recorded, then parsed
+    void receiveUEvent(const char *data, int size, qint64 timestamp = 0);
+    QByteArray record_file;
+    QDeviceUEventRecorder recorder;
+    QDeviceUEventSource *source; //netlink if not set
+    int source_fd; //polled for pending uevents, -1 if stopped
+    int netlink_socket; //-1 if the source is not netlink
+    QDeviceReaderThread *reader;
+    class QSocketNotifier *drain_notifier; //activated by the reader thread
+    QDeviceNameTable names;
+    QDeviceCoalescer coalescer;
+    class QTimer *coalesce_timer; //runs while the coalescer holds events
+    QList<QDeviceUEvent> coalesce_ready;
+    void deliverCoalesced();
+    mutable QDeviceAttributeCache attributes;
+    int mountinfo_fd; //-1 if mounts are not tracked
+    class QSocketNotifier *mount_notifier; //POLLPRI when the mount table changes
+    QByteArray mountinfo; //read buffer, grows to the table's size
+    QDeviceMountTable mount_table;
+    //report false: the initial table, nothing is emitted
+    void readMountTable(bool report);
+    QDeviceTransactions transactions;
+    class QTimer *settle_timer; //single shot at the earliest deadline
+    QElapsedTimer settle_clock;
+    void groupUEvent(const QDeviceUEvent &uevent);
+    /*!
+      Events lost in the receiving thread: receive queue overflows (ENOBUFS) and gaps in
+      SEQNUM. SEQNUM is only checked for the KernelGroup and if no event is dropped before it
+      is parsed, i.e. no socket filter is attached. Set in the receiving thread, resync() in
+      endBatch()
+    */
+    QAtomicInt events_lost;
+    quint64 last_seqnum;
+    bool track_seqnum;
+    void resync();
+    //a datagram of action with the last known properties of dev, without SEQNUM as it was not sent
+    static QByteArray synthesizeUEvent(const QDeviceUEvent &dev, const QByteArray &action);
+    //reports the removal of the known devices below a removed one, deepest first
+    void removeDescendants(const QDeviceUEvent &uevent);
+    //receive buffer policy, only touched in the receiving thread
+    int rcvbuf; //requested
+    bool rcvbuf_force;
+    int rcvbuf_quiet;
+    quint32 rcvbuf_drops;
+    bool setReceiveBuffer(int size);
+    int queuedBytes(int fd, quint32 *drops) const;
+    void adaptReceiveBuffer(int queued, bool overflow);
+#endif //Q_OS_LINUX
 
 private slots:
     void parseDeviceInfo();
+    //dispatch the events parsed by the reader thread
+    void drainReader();
+    //deliver the events held by the coalescer that are due
+    void coalesceTick();
+    //emit the transactions that have settled
+    void settleTransactions();
+    //the mount table changed
+    void mountTableChanged();
 
 private:
     QDeviceWatcher *watcher;
@@ -97,8 +854,12 @@ private:
     virtual void run();
 #endif //CONFIG_THREAD
 #if defined(Q_OS_LINUX)
-    QBuffer buffer;
-    void parseLine(const QByteArray &line);
+    QByteArray buffer; //receive buffers for a whole batch, allocated once in init()
+    struct sockaddr_nl *recv_addr;
+    struct mmsghdr *recv_msgs;
+    struct iovec *recv_iov;
+    char *recv_control; //SCM_TIMESTAMPNS of each datagram
+    QList<QByteArray> scanDevices() const;
 #if CONFIG_TCPSOCKET
     class QTcpSocket *tcp_socket;
 #elif CONFIG_SOCKETNOTIFIER
@@ -106,7 +867,6 @@ private:
 #endif
 
     QString bus_name;
-    int netlink_socket;
 #elif defined(Q_OS_WIN32)
     HWND hwnd;
 #elif defined(Q_OS_WINCE)
@@ -238,16 +238,13 @@ LRESULT CALLBACK dw_internal_proc(HWND hwnd, UINT message, WPARAM wParam, LPARAM
 #endif
         if (lpdb && watcher)
         {
-            QString action_str("change");
             QDeviceChangeEvent::Action action {QDeviceChangeEvent::Change};
             if (wParam == DBT_DEVICEARRIVAL)
             {
-                action_str = "add";
                 action = QDeviceChangeEvent::Add;
             }
             else if (wParam == DBT_DEVICEREMOVECOMPLETE)
             {
-                action_str = "remove";
                 action = QDeviceChangeEvent::Remove;
             }
 
@@ -287,22 +284,9 @@ LRESULT CALLBACK dw_internal_proc(HWND hwnd, UINT message, WPARAM wParam, LPARAM
 
             if (!device.isEmpty())
             {
-                QList<QDeviceChangeEvent *> events;
-                watcher->emitDeviceAction(device, action_str);
-                if (!watcher->event_receivers.isEmpty())
-                {
-                    events.append(new QDeviceChangeEvent(action, device));
-                }
-                if (!events.isEmpty() && !watcher->event_receivers.isEmpty())
-                {
-                    foreach (QObject *obj, watcher->event_receivers)
-                    {
-                        foreach (QDeviceChangeEvent *event, events)
-                        {
-                            QCoreApplication::postEvent(obj, event, Qt::HighEventPriority);
-                        }
-                    }
-                }
+                const QDeviceUEvent uevent(static_cast<QDeviceUEvent::Action>(action), device);
+                watcher->emitDeviceAction(device, uevent.action());
+                watcher->postDeviceChangeEvent(uevent);
             }
         }
     }
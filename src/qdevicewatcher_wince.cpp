@@ -109,19 +109,9 @@ void QDeviceWatcherPrivate::run()
         if (WaitForSingleObject(mQueueHandle, 3000) == WAIT_OBJECT_0) {
             while (ReadMsgQueue(mQueueHandle, &detail, sizeof(detail), &size, 1, &flags)) {
                 QString dev = TCHAR2QString(detail.d.szName);
-                QDeviceChangeEvent *event = 0;
-                if (detail.d.fAttached) {
-                    emitDeviceAdded(dev);
-                    event = new QDeviceChangeEvent(QDeviceChangeEvent::Add, dev);
-                } else {
-                    emitDeviceRemoved(dev);
-                    event = new QDeviceChangeEvent(QDeviceChangeEvent::Remove, dev);
-                }
-                if (event != 0 && !event_receivers.isEmpty()) {
-                    foreach (QObject *obj, event_receivers) {
-                        QCoreApplication::postEvent(obj, event, Qt::HighEventPriority);
-                    }
-                }
+                const QDeviceUEvent uevent(detail.d.fAttached ? QDeviceUEvent::Add : QDeviceUEvent::Remove, dev);
+                emitDeviceAction(dev, uevent.action());
+                postDeviceChangeEvent(uevent);
             }
         }
     }
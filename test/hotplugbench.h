@@ -0,0 +1,149 @@
+/******************************************************************************
+	HotplugBench: throughput and latency of the uevent hot path
+    Copyright (C) 2011-2015 Wang Bin <wbsecg1@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+******************************************************************************/
+
+#ifndef HOTPLUGBENCH_H
+#define HOTPLUGBENCH_H
+
+#include "qdevicewatcher.h"
+#include <QtCore/QEventLoop>
+#include <QtCore/QThread>
+#include <QtCore/QVector>
+
+#include <sys/socket.h>
+#include <time.h>
+
+static inline qint64 monotonicTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static inline qint64 threadCpuTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+//heap allocations so far, 0 if they are not counted
+quint64 allocationCount();
+
+/*!
+  Sends the datagrams to one end of a socketpair, the watcher reads the other end. send()
+  blocks while the watcher's queue is full, so nothing is lost. rate 0 sends as fast as
+  possible, otherwise that many datagrams per second.
+*/
+class BenchWriter : public QThread
+{
+public:
+    BenchWriter(int fd, const QList<QByteArray> &datagrams, int rate)
+        : cpu_time(0)
+        , fd(fd)
+        , datagrams(datagrams)
+        , rate(rate)
+    {
+        sent.resize(datagrams.size());
+    }
+
+    QVector<qint64> sent; //send time of each datagram
+    qint64 cpu_time;
+
+protected:
+    virtual void run()
+    {
+        const qint64 cpu = threadCpuTime();
+        const qint64 start = monotonicTime();
+        for (int i = 0; i < datagrams.size(); ++i) {
+            if (rate > 0) {
+                const qint64 due = start + qint64(i) * 1000000000 / rate;
+                while (monotonicTime() < due) {}
+            }
+            const QByteArray &datagram = datagrams.at(i);
+            sent[i] = monotonicTime();
+            if (send(fd, datagram.constData(), datagram.size(), 0) < 0)
+                qWarning("send failed");
+        }
+        cpu_time = threadCpuTime() - cpu;
+    }
+
+private:
+    int fd;
+    QList<QByteArray> datagrams;
+    int rate;
+};
+
+/*!
+  Counts deliveries of one kind and takes their time. Events arrive in the order they were
+  sent, so the n-th delivery belongs to the n-th datagram. The allocations are counted from
+  the warmup-th delivery to the last one, when pools and buffers have grown to their size.
+*/
+class BenchReceiver : public QObject
+{
+    Q_OBJECT
+public:
+    explicit BenchReceiver(int expected, QEventLoop *loop)
+        : expected(expected)
+        , received(0)
+        , warmup(expected / 10)
+        , steady_allocations(0)
+        , loop(loop)
+    {
+        delivered.resize(expected);
+    }
+
+    QVector<qint64> delivered;
+    int expected;
+    int received;
+    int warmup;
+    quint64 steady_allocations;
+
+public slots:
+    void slotDevice(const QString &) { deliver(1); }
+    void slotDevices(const QList<QDeviceUEvent> &uevents) { deliver(uevents.size()); }
+
+protected:
+    virtual bool event(QEvent *e)
+    {
+        if (e->type() == QDeviceChangeEvent::registeredType()) {
+            deliver(1);
+            return true;
+        }
+        return QObject::event(e);
+    }
+
+private:
+    void deliver(int count)
+    {
+        const qint64 now = monotonicTime();
+        for (int i = 0; i < count && received < expected; ++i) {
+            if (received == warmup)
+                steady_allocations = allocationCount();
+            delivered[received++] = now;
+        }
+        if (received == expected) {
+            steady_allocations = allocationCount() - steady_allocations;
+            loop->quit();
+        }
+    }
+
+    QEventLoop *loop;
+};
+
+#endif // HOTPLUGBENCH_H
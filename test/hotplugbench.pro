@@ -0,0 +1,19 @@
+TEMPLATE = app
+QT		 -= gui
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TARGET = hotplugbench
+
+include(../src/libQDeviceWatcher.pri)
+
+SOURCES += main_bench.cpp
+HEADERS += hotplugbench.h
+
+#make check: fails if the hot path allocates once the pools are filled. Qt 6 only: in Qt 5 a
+#QByteArray view of raw data (setRawData(), fromRawData()) allocates its header
+greaterThan(QT_MAJOR_VERSION, 5) {
+    check.commands = ./$$TARGET -check -count 20000 && ./$$TARGET -check -count 20000 -reader
+    check.depends = $(TARGET)
+    QMAKE_EXTRA_TARGETS += check
+}
@@ -0,0 +1,312 @@
+/******************************************************************************
+	HotplugBench: throughput and latency of the uevent hot path
+    Copyright (C) 2011-2015 Wang Bin <wbsecg1@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+******************************************************************************/
+
+/*!
+  Synthetic uevents are written to a socketpair and read by a QDeviceWatcher through
+  QDeviceWatcher::setSourceDescriptor(), so the library's receive, parse and delivery code
+  runs exactly as with netlink, without root or hardware.
+
+  usage: hotplugbench [-pattern disk|usb|tty|storm|change|all] [-mode signal|event|batch|all]
+                      [-count N] [-rate N] [-reader] [-check]
+  -rate sends N events per second instead of as fast as possible. Without it the latency
+  includes the time queued behind the previous events.
+  -check fails if any heap allocation happens after the first 10% of the events, i.e. once the
+  pools are filled. Without -pattern it runs the change pattern, where the set of devices is
+  stable; adding and removing devices grows and shrinks the registry's hashes. With Qt 6
+  "make check" runs it in both receive modes and fails with it.
+*/
+
+#include "hotplugbench.h"
+#include <QtCore/QAtomicInteger>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QStringList>
+#include <QtCore/QTimer>
+
+#include <algorithm>
+#include <stdio.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+//count heap allocations by wrapping glibc's allocator, operator new ends up here too
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+static QAtomicInteger<quint64> allocations;
+
+extern "C" void *malloc(size_t size)
+{
+    allocations.fetchAndAddRelaxed(1);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+    allocations.fetchAndAddRelaxed(1);
+    return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    allocations.fetchAndAddRelaxed(1);
+    return __libc_realloc(ptr, size);
+}
+
+quint64 allocationCount()
+{
+    return allocations.loadRelaxed();
+}
+#else
+quint64 allocationCount()
+{
+    return 0;
+}
+#endif //__GLIBC__
+
+enum Mode { SignalMode, EventMode, BatchMode };
+
+static QByteArray makeUEvent(const char *action, const QByteArray &devpath, const char *subsystem,
+                             const char *devtype, const QByteArray &devname, int major, int minor)
+{
+    static quint64 seqnum = 0;
+    QByteArray uevent;
+    uevent.append(action).append('@').append(devpath).append('\0');
+    uevent.append("ACTION=").append(action).append('\0');
+    uevent.append("DEVPATH=").append(devpath).append('\0');
+    uevent.append("SUBSYSTEM=").append(subsystem).append('\0');
+    if (devtype)
+        uevent.append("DEVTYPE=").append(devtype).append('\0');
+    if (!devname.isEmpty()) {
+        uevent.append("DEVNAME=").append(devname).append('\0');
+        uevent.append("MAJOR=").append(QByteArray::number(major)).append('\0');
+        uevent.append("MINOR=").append(QByteArray::number(minor)).append('\0');
+    }
+    uevent.append("SEQNUM=").append(QByteArray::number(++seqnum)).append('\0');
+    return uevent;
+}
+
+//a usb stick with 2 partitions: plugged, changed, unplugged
+static void diskPattern(QList<QByteArray> *out, int k)
+{
+    QByteArray disk("sd");
+    disk.append(char('b' + k % 8));
+    const QByteArray path = "/devices/pci0000:00/0000:00:14.0/usb2/2-1/2-1:1.0/host6/target6:0:0/6:0:0:0/block/" + disk;
+    const int minor = 16 * (k % 8 + 1);
+    out->append(makeUEvent("add", path, "block", "disk", disk, 8, minor));
+    out->append(makeUEvent("add", path + "/" + disk + "1", "block", "partition", disk + "1", 8, minor + 1));
+    out->append(makeUEvent("add", path + "/" + disk + "2", "block", "partition", disk + "2", 8, minor + 2));
+    out->append(makeUEvent("change", path, "block", "disk", disk, 8, minor));
+    out->append(makeUEvent("remove", path + "/" + disk + "2", "block", "partition", disk + "2", 8, minor + 2));
+    out->append(makeUEvent("remove", path + "/" + disk + "1", "block", "partition", disk + "1", 8, minor + 1));
+    out->append(makeUEvent("remove", path, "block", "disk", disk, 8, minor));
+}
+
+static void usbPattern(QList<QByteArray> *out, int k)
+{
+    const QByteArray port = "1-" + QByteArray::number(k % 16 + 1);
+    const QByteArray path = "/devices/pci0000:00/0000:00:14.0/usb1/" + port;
+    const QByteArray node = "bus/usb/001/" + QByteArray::number(100 + k % 16);
+    out->append(makeUEvent("add", path, "usb", "usb_device", node, 189, k % 16));
+    out->append(makeUEvent("add", path + "/" + port + ":1.0", "usb", "usb_interface", QByteArray(), 0, 0));
+    out->append(makeUEvent("remove", path + "/" + port + ":1.0", "usb", "usb_interface", QByteArray(), 0, 0));
+    out->append(makeUEvent("remove", path, "usb", "usb_device", node, 189, k % 16));
+}
+
+static void ttyPattern(QList<QByteArray> *out, int k)
+{
+    const QByteArray tty = "ttyUSB" + QByteArray::number(k % 4);
+    const QByteArray path = "/devices/pci0000:00/0000:00:14.0/usb1/1-2/1-2:1.0/" + tty + "/tty/" + tty;
+    out->append(makeUEvent("add", path, "tty", 0, tty, 188, k % 4));
+    out->append(makeUEvent("change", path, "tty", 0, tty, 188, k % 4));
+    out->append(makeUEvent("remove", path, "tty", 0, tty, 188, k % 4));
+}
+
+//removable media polling: the same 8 drives report a change over and over
+static void changePattern(QList<QByteArray> *out, int k)
+{
+    for (int i = 0; i < 8; ++i) {
+        const QByteArray sr = "sr" + QByteArray::number(i);
+        const QByteArray path = "/devices/pci0000:00/0000:00:1f.2/ata" + QByteArray::number(i + 1) + "/host" + QByteArray::number(i)
+                                + "/target" + QByteArray::number(i) + ":0:0/" + QByteArray::number(i) + ":0:0:0/block/" + sr;
+        out->append(makeUEvent(k == 0 ? "add" : "change", path, "block", "disk", sr, 11, i));
+    }
+}
+
+//a burst of 256 partitions appearing at once, then disappearing
+static void stormPattern(QList<QByteArray> *out, int)
+{
+    const QByteArray path = "/devices/virtual/block/loop0/loop0p";
+    for (int i = 1; i <= 256; ++i)
+        out->append(makeUEvent("add", path + QByteArray::number(i), "block", "partition", "loop0p" + QByteArray::number(i), 259, i));
+    for (int i = 1; i <= 256; ++i)
+        out->append(makeUEvent("remove", path + QByteArray::number(i), "block", "partition", "loop0p" + QByteArray::number(i), 259, i));
+}
+
+static QList<QByteArray> generate(const QString &pattern, int count)
+{
+    void (*make)(QList<QByteArray> *, int) = diskPattern;
+    if (pattern == "usb")
+        make = usbPattern;
+    else if (pattern == "tty")
+        make = ttyPattern;
+    else if (pattern == "storm")
+        make = stormPattern;
+    else if (pattern == "change")
+        make = changePattern;
+    QList<QByteArray> datagrams;
+    for (int k = 0; datagrams.size() < count; ++k)
+        make(&datagrams, k);
+    return datagrams.mid(0, count);
+}
+
+static double percentile(const QVector<qint64> &sorted, double p)
+{
+    if (sorted.isEmpty())
+        return 0;
+    return sorted.at(qMin(sorted.size() - 1, int(sorted.size() * p))) / 1000.0;
+}
+
+static bool run(const QString &pattern, Mode mode, int count, int rate, bool reader, bool check)
+{
+    static const char *const modes[] = {"signal", "event", "batch"};
+    const QList<QByteArray> datagrams = generate(pattern, count);
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        qWarning("socketpair failed");
+        return false;
+    }
+
+    QEventLoop loop;
+    BenchReceiver receiver(datagrams.size(), &loop);
+    QDeviceWatcher watcher;
+    watcher.setSourceDescriptor(sv[0]);
+    watcher.setReaderThreadEnabled(reader);
+    if (mode == BatchMode) {
+        watcher.setDelivery(QDeviceWatcher::BatchDelivery);
+        QObject::connect(&watcher, SIGNAL(devicesChanged(QList<QDeviceUEvent>)), &receiver, SLOT(slotDevices(QList<QDeviceUEvent>)));
+    } else {
+        watcher.setDelivery(QDeviceWatcher::PerDeviceDelivery);
+        if (mode == EventMode) {
+            watcher.appendEventReceiver(&receiver);
+        } else {
+            QObject::connect(&watcher, SIGNAL(deviceAdded(QString)), &receiver, SLOT(slotDevice(QString)));
+            QObject::connect(&watcher, SIGNAL(deviceChanged(QString)), &receiver, SLOT(slotDevice(QString)));
+            QObject::connect(&watcher, SIGNAL(deviceRemoved(QString)), &receiver, SLOT(slotDevice(QString)));
+        }
+    }
+    watcher.start();
+    QTimer::singleShot(60000, &loop, SLOT(quit()));
+
+    BenchWriter writer(sv[1], datagrams, rate);
+    const quint64 allocs = allocationCount();
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    const qint64 cpu = qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    const qint64 start = monotonicTime();
+    writer.start();
+    loop.exec();
+    const qint64 wall = monotonicTime() - start;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    writer.wait();
+    const qint64 cpu_used = qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec - cpu - writer.cpu_time;
+    const double allocs_used = allocationCount() - allocs;
+    watcher.stop();
+    close(sv[0]);
+    close(sv[1]);
+
+    const int n = receiver.received;
+    if (n < datagrams.size())
+        qWarning("%s %s: only %d of %d events delivered", qPrintable(pattern), modes[mode], n, datagrams.size());
+    QVector<qint64> latency(n);
+    for (int i = 0; i < n; ++i)
+        latency[i] = receiver.delivered.at(i) - writer.sent.at(i);
+    std::sort(latency.begin(), latency.end());
+    const quint64 steady = n == datagrams.size() ? receiver.steady_allocations : 0;
+    printf("%-6s %-6s %-6s %10.0f ev/s %8.0f ns cpu/ev %6.2f allocs/ev %6.2f steady  p50 %9.1f us  p99 %9.1f us  p999 %9.1f us\n",
+           qPrintable(pattern),
+           modes[mode],
+           reader ? "thread" : "loop",
+           n * 1e9 / qMax<qint64>(wall, 1),
+           double(cpu_used) / qMax(n, 1),
+           allocs_used / qMax(n, 1),
+           double(steady) / qMax(n - receiver.warmup, 1),
+           percentile(latency, 0.5),
+           percentile(latency, 0.99),
+           percentile(latency, 0.999));
+    fflush(stdout);
+    if (check && steady > 0) {
+        qWarning("%s %s: %llu allocations in the steady state", qPrintable(pattern), modes[mode], steady);
+        return false;
+    }
+    return n == datagrams.size();
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QStringList patterns = QStringList() << "disk" << "usb" << "tty" << "storm" << "change";
+    QStringList modes = QStringList() << "signal" << "event" << "batch";
+    int count = 100000;
+    int rate = 0;
+    bool reader = false;
+    bool check = false;
+    bool pattern_set = false;
+    const QStringList args = a.arguments();
+    for (int i = 1; i < args.size(); ++i) {
+        const QString &arg = args.at(i);
+        const QString value = i + 1 < args.size() ? args.at(i + 1) : QString();
+        if (arg == "-pattern" && value != "all") {
+            patterns = QStringList() << value;
+            pattern_set = true;
+            ++i;
+        } else if (arg == "-mode" && value != "all") {
+            modes = QStringList() << value;
+            ++i;
+        } else if (arg == "-count") {
+            count = value.toInt();
+            ++i;
+        } else if (arg == "-rate") {
+            rate = value.toInt();
+            ++i;
+        } else if (arg == "-reader") {
+            reader = true;
+        } else if (arg == "-check") {
+            check = true;
+        } else if (arg == "-pattern" || arg == "-mode") {
+            pattern_set |= arg == "-pattern";
+            ++i;
+        }
+    }
+    if (check && !pattern_set)
+        patterns = QStringList() << "change";
+    if (check && allocationCount() == 0)
+        qWarning("allocations are not counted on this platform, -check passes anyway");
+    if (count <= 0) {
+        qWarning("invalid -count");
+        return 1;
+    }
+
+    bool ok = true;
+    foreach (const QString &pattern, patterns) {
+        foreach (const QString &mode, modes) {
+            const Mode m = mode == "event" ? EventMode : mode == "batch" ? BatchMode : SignalMode;
+            ok &= run(pattern, m, count, rate, reader, check);
+        }
+    }
+    return ok ? 0 : 1;
+}